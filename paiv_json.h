@@ -31,6 +31,7 @@
 
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 
 
@@ -52,6 +53,16 @@ typedef enum {
 } JsonError;
 
 
+typedef enum {
+    JsonIntType_i8,
+    JsonIntType_u8,
+    JsonIntType_i16,
+    JsonIntType_u16,
+    JsonIntType_i32,
+    JsonIntType_i64,
+} JsonIntType;
+
+
 typedef enum {
     JsonValueType_object,
     JsonValueType_array,
@@ -63,8 +74,24 @@ typedef enum {
 } JsonValueType;
 
 
+enum {
+    JsonStream_default_size = 64 * 1024,
+};
+
+
+typedef struct {
+    FILE* _file;
+    unsigned char* _buffer;
+    size_t _capacity;
+    size_t _position;
+    size_t _size;
+    int _owns_buffer;
+} JsonStream;
+
+
 typedef struct {
     FILE* _file;
+    JsonStream* _stream;
     int _element_count;
     int _parser_token;
     char _parser_char;
@@ -72,6 +99,9 @@ typedef struct {
 
 
 PVJDEF JsonError json_reader_init(JSON* context, FILE* file);
+PVJDEF JsonError json_reader_init_buffered(JSON* context, JsonStream* stream, FILE* file, size_t buf_size, void* buf);
+PVJDEF JsonError json_reader_init_memory(JSON* context, JsonStream* stream, const void* data, size_t size);
+PVJDEF JsonError json_reader_close(JSON* context);
 PVJDEF JsonError json_reader_open_object(JSON* context, JSON* object);
 PVJDEF JsonError json_reader_read_object(JSON* context, size_t* key_size, char* key, JsonValueType* value);
 PVJDEF JsonError json_reader_open_array(JSON* context, JSON* array);
@@ -82,6 +112,7 @@ PVJDEF JsonError json_reader_read_numberll(JSON* context, long long* value);
 PVJDEF JsonError json_reader_read_numberf(JSON* context, float* value);
 PVJDEF JsonError json_reader_read_numberd(JSON* context, double* value);
 PVJDEF JsonError json_reader_read_numberld(JSON* context, long double* value);
+PVJDEF JsonError json_reader_read_int_array(JSON* context, JsonIntType type, void* buf, size_t buf_size, size_t* count);
 PVJDEF JsonError json_reader_read_string(JSON* context, size_t* buf_size, char* buf);
 PVJDEF JsonError json_reader_resume_string(JSON* context, size_t* buf_size, char* buf);
 PVJDEF JsonError json_reader_read_bool(JSON* context, int* value);
@@ -90,6 +121,9 @@ PVJDEF JsonError json_reader_consume_value(JSON* context);
 PVJDEF JsonError json_reader_peek_value(JSON* context, JsonValueType* value);
 
 PVJDEF JsonError json_writer_init(JSON* context, FILE* file);
+PVJDEF JsonError json_writer_init_buffered(JSON* context, JsonStream* stream, FILE* file, size_t buf_size, void* buf);
+PVJDEF JsonError json_writer_flush(JSON* context);
+PVJDEF JsonError json_writer_close(JSON* context);
 PVJDEF JsonError json_writer_open_object(JSON* context, JSON* object);
 PVJDEF JsonError json_writer_close_object(JSON* object);
 PVJDEF JsonError json_writer_write_object_key_separator(JSON* object);
@@ -103,6 +137,7 @@ PVJDEF JsonError json_writer_write_numberll(JSON* context, long long value);
 PVJDEF JsonError json_writer_write_numberf(JSON* context, float value);
 PVJDEF JsonError json_writer_write_numberd(JSON* context, double value);
 PVJDEF JsonError json_writer_write_numberld(JSON* context, long double value);
+PVJDEF JsonError json_writer_write_int_array(JSON* context, JsonIntType type, const void* buf, size_t count);
 PVJDEF JsonError json_writer_write_string(JSON* context, const char* value);
 PVJDEF JsonError json_writer_write_bool(JSON* context, int value);
 PVJDEF JsonError json_writer_write_null(JSON* context);
@@ -118,6 +153,9 @@ PVJDEF JsonError json_writer_write_null(JSON* context);
 
 #ifdef PAIV_JSON_IMPLEMENTATION
 
+#include <stdlib.h>
+#include <string.h>
+
 
 typedef enum {
     _TokenType_invalid,
@@ -136,16 +174,75 @@ typedef enum {
 } _TokenType;
 
 
+enum {
+    _JsonStream_lookbehind = 8,
+};
+
+
 static void
 _json_parser_init(JSON* state) {
     state->_parser_token = _TokenType_invalid;
 }
 
 
+static int
+_json_stream_refill(JsonStream* stream) {
+    if (stream->_file == NULL) {
+        return EOF;
+    }
+    size_t keep = stream->_size < _JsonStream_lookbehind ? stream->_size : _JsonStream_lookbehind;
+    memmove(stream->_buffer, &stream->_buffer[stream->_size - keep], keep);
+    size_t n = fread(&stream->_buffer[keep], 1, stream->_capacity - keep, stream->_file);
+    stream->_position = keep;
+    stream->_size = keep + n;
+    if (n == 0) {
+        return EOF;
+    }
+    return stream->_buffer[stream->_position++];
+}
+
+
+static inline int
+_json_stream_getc(JSON* state) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        return fgetc(state->_file);
+    }
+    if (stream->_position < stream->_size) {
+        return stream->_buffer[stream->_position++];
+    }
+    return _json_stream_refill(stream);
+}
+
+
+static inline void
+_json_stream_ungetc(JSON* state, int c) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        ungetc(c, state->_file);
+    }
+    else if (c != EOF) {
+        stream->_position--;
+    }
+}
+
+
+static void
+_json_stream_unread(JSON* state, size_t count) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        fseek(state->_file, -(long)count, SEEK_CUR);
+    }
+    else {
+        stream->_position -= count;
+    }
+}
+
+
 static JsonError
-_json_parser_read_token(JSON* state, FILE* fp, _TokenType* token) {
+_json_parser_read_token(JSON* state, _TokenType* token) {
     for (;;) {
-        int c = fgetc(fp);
+        int c = _json_stream_getc(state);
         switch (c) {
             case 0x09:
             case 0x0A:
@@ -185,28 +282,28 @@ _json_parser_read_token(JSON* state, FILE* fp, _TokenType* token) {
                         break;
                     case 't':
                         if (
-                            fgetc(fp) == 'r' &&
-                            fgetc(fp) == 'u' &&
-                            fgetc(fp) == 'e'
+                            _json_stream_getc(state) == 'r' &&
+                            _json_stream_getc(state) == 'u' &&
+                            _json_stream_getc(state) == 'e'
                             ) {
                             t = _TokenType_bool_true;
                         }
                         break;
                     case 'f':
                         if (
-                            fgetc(fp) == 'a' &&
-                            fgetc(fp) == 'l' &&
-                            fgetc(fp) == 's' &&
-                            fgetc(fp) == 'e'
+                            _json_stream_getc(state) == 'a' &&
+                            _json_stream_getc(state) == 'l' &&
+                            _json_stream_getc(state) == 's' &&
+                            _json_stream_getc(state) == 'e'
                             ) {
                             t = _TokenType_bool_false;
                         }
                         break;
                     case 'n':
                         if (
-                            fgetc(fp) == 'u' &&
-                            fgetc(fp) == 'l' &&
-                            fgetc(fp) == 'l'
+                            _json_stream_getc(state) == 'u' &&
+                            _json_stream_getc(state) == 'l' &&
+                            _json_stream_getc(state) == 'l'
                             ) {
                             t = _TokenType_null_value;
                         }
@@ -225,9 +322,9 @@ _json_parser_read_token(JSON* state, FILE* fp, _TokenType* token) {
 
 
 static JsonError
-_json_parser_peek_token(JSON* state, FILE* fp, _TokenType* token) {
+_json_parser_peek_token(JSON* state, _TokenType* token) {
     for (;;) {
-        int c = fgetc(fp);
+        int c = _json_stream_getc(state);
         switch (c) {
             case 0x09:
             case 0x0A:
@@ -237,7 +334,7 @@ _json_parser_peek_token(JSON* state, FILE* fp, _TokenType* token) {
             case EOF:
                 return JsonError_eof;
             default: {
-                ungetc(c, fp);
+                _json_stream_ungetc(state, c);
                 _TokenType t = _TokenType_invalid;
                 switch (c) {
                     case '{':
@@ -286,12 +383,12 @@ _json_parser_peek_token(JSON* state, FILE* fp, _TokenType* token) {
 
 
 static JsonError
-_json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
+_json_parser_read_string(JSON* context, size_t* buf_size, char* buf) {
     size_t capacity = *buf_size;
     size_t count = 0;
     int state = 0;
     for (;;) {
-        int c = fgetc(fp);
+        int c = _json_stream_getc(context);
         if (c == EOF) {
             return JsonError_eof;
         }
@@ -305,7 +402,7 @@ _json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
                             return JsonError_ok;
                         }
                         else {
-                            ungetc(c, fp);
+                            _json_stream_ungetc(context, c);
                             *buf_size = count;
                             return JsonError_bufsize;
                         }
@@ -324,7 +421,7 @@ _json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
                             count++;
                         }
                         else {
-                            ungetc(c, fp);
+                            _json_stream_ungetc(context, c);
                             *buf_size = count;
                             return JsonError_bufsize;
                         }
@@ -367,7 +464,7 @@ _json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
                         state = 0;
                     }
                     else {
-                        fseek(fp, -2, SEEK_CUR);
+                        _json_stream_unread(context, 2);
                         *buf_size = count;
                         return JsonError_bufsize;
                     }
@@ -378,7 +475,7 @@ _json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
                 size_t i;
                 for (i = 0; i < 4; ++i) {
                     if (i != 0) {
-                        c = fgetc(fp);
+                        c = _json_stream_getc(context);
                     }
                     if (c == EOF) {
                         return JsonError_eof;
@@ -422,7 +519,7 @@ _json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
                     state = 0;
                 }
                 else {
-                    fseek(fp, -6, SEEK_CUR);
+                    _json_stream_unread(context, 6);
                     *buf_size = count;
                     return JsonError_bufsize;
                 }
@@ -434,10 +531,10 @@ _json_parser_read_string(JSON* _, FILE* fp, size_t* buf_size, char* buf) {
 
 
 static JsonError
-_json_parser_consume_string(JSON* _, FILE* fp) {
+_json_parser_consume_string(JSON* context) {
     int state = 0;
     for (;;) {
-        int c = fgetc(fp);
+        int c = _json_stream_getc(context);
         if (c == EOF) {
             return JsonError_eof;
         }
@@ -495,7 +592,7 @@ _json_parser_consume_string(JSON* _, FILE* fp) {
                 size_t i;
                 for (i = 0; i < 4; ++i) {
                     if (i != 0) {
-                        c = fgetc(fp);
+                        c = _json_stream_getc(context);
                     }
                     if (c == EOF) {
                         return JsonError_eof;
@@ -518,7 +615,7 @@ _json_parser_consume_string(JSON* _, FILE* fp) {
 
 
 static JsonError
-_json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE* value, PAIV_JSON_NUMBER_BACKEND_TYPE* exponent) {
+_json_parser_read_number(JSON* context, PAIV_JSON_NUMBER_BACKEND_TYPE* value, PAIV_JSON_NUMBER_BACKEND_TYPE* exponent) {
     PAIV_JSON_NUMBER_BACKEND_TYPE x = 0;
     PAIV_JSON_NUMBER_BACKEND_TYPE y = 0;
     int sign = 1;
@@ -531,9 +628,9 @@ _json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE*
         context->_parser_token = _TokenType_invalid;
     }
     else {
-        c = fgetc(fp);
+        c = _json_stream_getc(context);
     }
-    for (;; c = fgetc(fp)) {
+    for (;; c = _json_stream_getc(context)) {
         switch (state) {
             case 0:
                 switch (c) {
@@ -617,7 +714,7 @@ _json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE*
                         *exponent = 0;
                         return JsonError_ok;
                     default:
-                        ungetc(c, fp);
+                        _json_stream_ungetc(context, c);
                         *value = x * sign;
                         *exponent = 0;
                         return JsonError_ok;
@@ -637,7 +734,7 @@ _json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE*
                         *exponent = 0;
                         return JsonError_ok;
                     default:
-                        ungetc(c, fp);
+                        _json_stream_ungetc(context, c);
                         *value = x * sign;
                         *exponent = 0;
                         return JsonError_ok;
@@ -693,7 +790,7 @@ _json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE*
                         *exponent = -decs;
                         return JsonError_ok;
                     default:
-                        ungetc(c, fp);
+                        _json_stream_ungetc(context, c);
                         *value = x * sign;
                         *exponent = -decs;
                         return JsonError_ok;
@@ -747,7 +844,7 @@ _json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE*
                         *exponent = y * msign - decs;
                         return JsonError_ok;
                     default:
-                        ungetc(c, fp);
+                        _json_stream_ungetc(context, c);
                         *value = x * sign;
                         *exponent = y * msign - decs;
                         return JsonError_ok;
@@ -761,16 +858,84 @@ _json_parser_read_number(JSON* context, FILE* fp, PAIV_JSON_NUMBER_BACKEND_TYPE*
 PVJDEF JsonError
 json_reader_init(JSON* state, FILE* file) {
     state->_file = file;
+    state->_stream = NULL;
     state->_element_count = 0;
     _json_parser_init(state);
     return JsonError_ok;
 }
 
 
+PVJDEF JsonError
+json_reader_init_buffered(JSON* state, JsonStream* stream, FILE* file, size_t buf_size, void* buf) {
+    if (buf == NULL) {
+        buf_size = JsonStream_default_size;
+        buf = malloc(buf_size);
+        if (buf == NULL) {
+            return JsonError_bufsize;
+        }
+        stream->_owns_buffer = 1;
+    }
+    else if (buf_size <= _JsonStream_lookbehind) {
+        return JsonError_bufsize;
+    }
+    else {
+        stream->_owns_buffer = 0;
+    }
+    stream->_file = file;
+    stream->_buffer = buf;
+    stream->_capacity = buf_size;
+    stream->_position = 0;
+    stream->_size = 0;
+    JsonError err = json_reader_init(state, file);
+    state->_stream = stream;
+    return err;
+}
+
+
+PVJDEF JsonError
+json_reader_init_memory(JSON* state, JsonStream* stream, const void* data, size_t size) {
+    stream->_file = NULL;
+    stream->_buffer = (unsigned char*) data;
+    stream->_capacity = size;
+    stream->_position = 0;
+    stream->_size = size;
+    stream->_owns_buffer = 0;
+    JsonError err = json_reader_init(state, NULL);
+    state->_stream = stream;
+    return err;
+}
+
+
+PVJDEF JsonError
+json_reader_close(JSON* state) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        return JsonError_ok;
+    }
+    if (stream->_file != NULL && stream->_position < stream->_size) {
+        fseek(stream->_file, -(long)(stream->_size - stream->_position), SEEK_CUR);
+    }
+    if (stream->_owns_buffer != 0) {
+        free(stream->_buffer);
+    }
+    *stream = (JsonStream) {};
+    state->_stream = NULL;
+    return JsonError_ok;
+}
+
+
+static JsonError
+_json_reader_init_nested(JSON* state, JSON* nested) {
+    JsonError err = json_reader_init(nested, state->_file);
+    nested->_stream = state->_stream;
+    return err;
+}
+
+
 PVJDEF JsonError
 json_reader_open_object(JSON* state, JSON* object) {
     _TokenType token;
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -782,7 +947,7 @@ json_reader_open_object(JSON* state, JSON* object) {
         default:
             return JsonError_type_mismatch;
     }
-    err = json_reader_init(object, state->_file);
+    err = _json_reader_init_nested(state, object);
     return err;
 }
 
@@ -791,7 +956,7 @@ PVJDEF JsonError
 json_reader_read_object(JSON* state, size_t* key_size, char* key, JsonValueType* value) {
     _TokenType token;
     if (state->_element_count != 0) {
-        JsonError err = _json_parser_read_token(state, state->_file, &token);
+        JsonError err = _json_parser_read_token(state, &token);
         if (err != JsonError_ok) { return err; }
         switch (token) {
             case _TokenType_object_close:
@@ -802,7 +967,7 @@ json_reader_read_object(JSON* state, size_t* key_size, char* key, JsonValueType*
                 return JsonError_invalid;
         }
     }
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) { return err; }
     switch (token) {
         case _TokenType_string_open:
@@ -815,11 +980,11 @@ json_reader_read_object(JSON* state, size_t* key_size, char* key, JsonValueType*
         default:
             return JsonError_invalid;
     }
-    err = _json_parser_read_string(state, state->_file, key_size, key);
+    err = _json_parser_read_string(state, key_size, key);
     if (err != JsonError_ok) {
         return err;
     }
-    err = _json_parser_read_token(state, state->_file, &token);
+    err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -841,7 +1006,7 @@ json_reader_read_object(JSON* state, size_t* key_size, char* key, JsonValueType*
 PVJDEF JsonError
 json_reader_open_array(JSON* state, JSON* array) {
     _TokenType token;
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -853,7 +1018,7 @@ json_reader_open_array(JSON* state, JSON* array) {
         default:
             return JsonError_type_mismatch;
     }
-    err = json_reader_init(array, state->_file);
+    err = _json_reader_init_nested(state, array);
     return err;
 }
 
@@ -862,7 +1027,7 @@ PVJDEF JsonError
 json_reader_read_array(JSON* state, JsonValueType* value) {
     _TokenType token;
     if (state->_element_count != 0) {
-        JsonError err = _json_parser_read_token(state, state->_file, &token);
+        JsonError err = _json_parser_read_token(state, &token);
         if (err != JsonError_ok) { return err; }
         switch (token) {
             case _TokenType_array_close:
@@ -873,7 +1038,7 @@ json_reader_read_array(JSON* state, JsonValueType* value) {
                 return JsonError_invalid;
         }
     }
-    JsonError err = _json_parser_peek_token(state, state->_file, &token);
+    JsonError err = _json_parser_peek_token(state, &token);
     if (err != JsonError_ok) { return err; }
     switch (token) {
         case _TokenType_bool_false:
@@ -901,7 +1066,7 @@ json_reader_read_array(JSON* state, JsonValueType* value) {
             if (state->_element_count != 0) {
                 return JsonError_invalid;
             }
-            _json_parser_read_token(state, state->_file, &token);
+            _json_parser_read_token(state, &token);
             return JsonError_not_found;
         case _TokenType_object_close:
         case _TokenType_key_separator:
@@ -918,7 +1083,7 @@ json_reader_read_array(JSON* state, JsonValueType* value) {
 static JsonError
 _json_reader_read_number(JSON* state, PAIV_JSON_NUMBER_BACKEND_TYPE* value, PAIV_JSON_NUMBER_BACKEND_TYPE* exponent) {
     _TokenType token;
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -930,7 +1095,7 @@ _json_reader_read_number(JSON* state, PAIV_JSON_NUMBER_BACKEND_TYPE* value, PAIV
         default:
             return JsonError_type_mismatch;
     }
-    err = _json_parser_read_number(state, state->_file, value, exponent);
+    err = _json_parser_read_number(state, value, exponent);
     return err;
 }
 
@@ -1009,10 +1174,174 @@ json_reader_read_numberld(JSON* state, long double* value) {
 }
 
 
+static int
+_json_parser_skip_space(JSON* state) {
+    for (;;) {
+        int c = _json_stream_getc(state);
+        switch (c) {
+            case 0x09:
+            case 0x0A:
+            case 0x0D:
+            case 0x20:
+                break;
+            default:
+                return c;
+        }
+    }
+}
+
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define _PAIV_JSON_SWAR 1
+#endif
+
+
+static JsonError
+_json_parser_read_integer(JSON* context, int c, long long* value) {
+    int sign = 0;
+    if (c == '-') {
+        sign = 1;
+        c = _json_stream_getc(context);
+    }
+    switch (c) {
+        case '0' ... '9':
+            break;
+        case EOF:
+            return JsonError_eof;
+        default:
+            return JsonError_invalid;
+    }
+    int lead = c;
+    /* magnitude of INT64_MIN for negatives, digits past it overflow */
+    uint64_t limit = (uint64_t)INT64_MAX + sign;
+    uint64_t x = c - '0';
+    int digits = 1;
+    int overflow = 0;
+#ifdef _PAIV_JSON_SWAR
+    JsonStream* stream = context->_stream;
+    if (stream != NULL) {
+        while (stream->_size - stream->_position >= sizeof(uint64_t)) {
+            const unsigned char* p = &stream->_buffer[stream->_position];
+            uint64_t w;
+            memcpy(&w, p, sizeof(w));
+            w ^= 0x3030303030303030ull;
+            uint64_t nondigit = (((w & 0x7F7F7F7F7F7F7F7Full) + 0x7676767676767676ull) | w) &
+                0x8080808080808080ull;
+            int run = nondigit == 0 ? 8 : __builtin_ctzll(nondigit) / 8;
+            for (int i = 0; i < run; ++i) {
+                unsigned d = p[i] - '0';
+                if (x > (limit - d) / 10) {
+                    overflow = 1;
+                }
+                else {
+                    x = x * 10 + d;
+                }
+            }
+            digits += run;
+            stream->_position += run;
+            if (run < 8) {
+                break;
+            }
+        }
+    }
+#endif
+    for (;;) {
+        c = _json_stream_getc(context);
+        if (c < '0' || c > '9') {
+            break;
+        }
+        unsigned d = c - '0';
+        if (x > (limit - d) / 10) {
+            overflow = 1;
+        }
+        else {
+            x = x * 10 + d;
+        }
+        ++digits;
+    }
+    if (overflow != 0 || (lead == '0' && digits > 1)) {
+        return JsonError_invalid;
+    }
+    switch (c) {
+        case '.':
+        case 'e':
+        case 'E':
+            return JsonError_type_mismatch;
+    }
+    _json_stream_ungetc(context, c);
+    if (sign == 0 || x == 0) {
+        *value = x;
+    }
+    else {
+        *value = -(long long)(x - 1) - 1;
+    }
+    return JsonError_ok;
+}
+
+
+PVJDEF JsonError
+json_reader_read_int_array(JSON* state, JsonIntType type, void* buf, size_t buf_size, size_t* count) {
+    long long lo, hi;
+    switch (type) {
+        case JsonIntType_i8: lo = INT8_MIN; hi = INT8_MAX; break;
+        case JsonIntType_u8: lo = 0; hi = UINT8_MAX; break;
+        case JsonIntType_i16: lo = INT16_MIN; hi = INT16_MAX; break;
+        case JsonIntType_u16: lo = 0; hi = UINT16_MAX; break;
+        case JsonIntType_i32: lo = INT32_MIN; hi = INT32_MAX; break;
+        case JsonIntType_i64: lo = INT64_MIN; hi = INT64_MAX; break;
+        default:
+            return JsonError_type_mismatch;
+    }
+    *count = 0;
+    JSON array;
+    JsonError err = json_reader_open_array(state, &array);
+    if (err != JsonError_ok) {
+        return err;
+    }
+    size_t n = 0;
+    for (;; ++n) {
+        int c = _json_parser_skip_space(&array);
+        if (c == ']') {
+            break;
+        }
+        if (n != 0) {
+            if (c != ',') {
+                return c == EOF ? JsonError_eof : JsonError_invalid;
+            }
+            c = _json_parser_skip_space(&array);
+        }
+        long long x;
+        err = _json_parser_read_integer(&array, c, &x);
+        if (err != JsonError_ok) {
+            *count = n;
+            return err;
+        }
+        if (x < lo || x > hi) {
+            *count = n;
+            return JsonError_invalid;
+        }
+        if (n >= buf_size) {
+            *count = n;
+            return JsonError_bufsize;
+        }
+        switch (type) {
+            case JsonIntType_i8: ((int8_t*)buf)[n] = x; break;
+            case JsonIntType_u8: ((uint8_t*)buf)[n] = x; break;
+            case JsonIntType_i16: ((int16_t*)buf)[n] = x; break;
+            case JsonIntType_u16: ((uint16_t*)buf)[n] = x; break;
+            case JsonIntType_i32: ((int32_t*)buf)[n] = x; break;
+            case JsonIntType_i64: ((int64_t*)buf)[n] = x; break;
+        }
+    }
+    *count = n;
+    return JsonError_ok;
+}
+
+
 PVJDEF JsonError
 json_reader_read_string(JSON* state, size_t* buf_size, char* buf) {
     _TokenType token;
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -1024,14 +1353,14 @@ json_reader_read_string(JSON* state, size_t* buf_size, char* buf) {
         default:
             return JsonError_type_mismatch;
     }
-    err = _json_parser_read_string(state, state->_file, buf_size, buf);
+    err = _json_parser_read_string(state, buf_size, buf);
     return err;
 }
 
 
 PVJDEF JsonError
 json_reader_resume_string(JSON* state, size_t* buf_size, char* buf) {
-    JsonError err = _json_parser_read_string(state, state->_file, buf_size, buf);
+    JsonError err = _json_parser_read_string(state, buf_size, buf);
     return err;
 }
 
@@ -1039,7 +1368,7 @@ json_reader_resume_string(JSON* state, size_t* buf_size, char* buf) {
 PVJDEF JsonError
 json_reader_read_bool(JSON* state, int* value) {
     _TokenType token;
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -1067,7 +1396,7 @@ json_reader_read_bool(JSON* state, int* value) {
 PVJDEF JsonError
 json_reader_read_null(JSON* state) {
     _TokenType token;
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -1095,7 +1424,7 @@ static JsonError _json_reader_consume_object(JSON* state);
 PVJDEF JsonError
 json_reader_consume_value(JSON* state) {
     _TokenType token;
-    JsonError err = _json_parser_peek_token(state, state->_file, &token);
+    JsonError err = _json_parser_peek_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -1103,17 +1432,17 @@ json_reader_consume_value(JSON* state) {
         case _TokenType_null_value:
         case _TokenType_bool_false:
         case _TokenType_bool_true:
-            err = _json_parser_read_token(state, state->_file, &token);
+            err = _json_parser_read_token(state, &token);
             return err;
         case _TokenType_string_open: {
-            err = _json_parser_read_token(state, state->_file, &token);
+            err = _json_parser_read_token(state, &token);
             if (err != JsonError_ok) { return err; }
-            err = _json_parser_consume_string(state, state->_file);
+            err = _json_parser_consume_string(state);
             return err;
             }
         case _TokenType_number: {
             long long value, exponent;
-            err = _json_parser_read_number(state, state->_file, &value, &exponent);
+            err = _json_parser_read_number(state, &value, &exponent);
             return err;
             }
         case _TokenType_array_open:
@@ -1148,7 +1477,7 @@ static JsonError
 _json_reader_consume_object_key(JSON* state) {
     _TokenType token;
     if (state->_element_count != 0) {
-        JsonError err = _json_parser_read_token(state, state->_file, &token);
+        JsonError err = _json_parser_read_token(state, &token);
         if (err != JsonError_ok) { return err; }
         switch (token) {
             case _TokenType_object_close:
@@ -1159,7 +1488,7 @@ _json_reader_consume_object_key(JSON* state) {
                 return JsonError_invalid;
         }
     }
-    JsonError err = _json_parser_read_token(state, state->_file, &token);
+    JsonError err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) { return err; }
     switch (token) {
         case _TokenType_string_open:
@@ -1172,11 +1501,11 @@ _json_reader_consume_object_key(JSON* state) {
         default:
             return JsonError_invalid;
     }
-    err = _json_parser_consume_string(state, state->_file);
+    err = _json_parser_consume_string(state);
     if (err != JsonError_ok) {
         return err;
     }
-    err = _json_parser_read_token(state, state->_file, &token);
+    err = _json_parser_read_token(state, &token);
     if (err != JsonError_ok) {
         return err;
     }
@@ -1210,7 +1539,7 @@ _json_reader_consume_object(JSON* state) {
 PVJDEF JsonError
 json_reader_peek_value(JSON* state, JsonValueType* value) {
     _TokenType token;
-    JsonError err = _json_parser_peek_token(state, state->_file, &token);
+    JsonError err = _json_parser_peek_token(state, &token);
     if (err != JsonError_ok) { return err; }
     switch (token) {
         case _TokenType_bool_false:
@@ -1241,44 +1570,190 @@ json_reader_peek_value(JSON* state, JsonValueType* value) {
 }
 
 
+static JsonError
+_json_writer_flush_stream(JsonStream* stream) {
+    if (stream->_size == 0) {
+        return JsonError_ok;
+    }
+    size_t size = stream->_size;
+    stream->_size = 0;
+    size_t n = fwrite(stream->_buffer, 1, size, stream->_file);
+    if (n != size) { return JsonError_write; }
+    return JsonError_ok;
+}
+
+
+static JsonError
+_json_writer_write(JSON* state, const char* data, size_t size) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        if (size != 0 && fwrite(data, 1, size, state->_file) != size) {
+            return JsonError_write;
+        }
+        return JsonError_ok;
+    }
+    if (stream->_capacity - stream->_size < size) {
+        JsonError err = _json_writer_flush_stream(stream);
+        if (err != JsonError_ok) { return err; }
+        if (size > stream->_capacity) {
+            if (fwrite(data, 1, size, stream->_file) != size) {
+                return JsonError_write;
+            }
+            return JsonError_ok;
+        }
+    }
+    memcpy(&stream->_buffer[stream->_size], data, size);
+    stream->_size += size;
+    return JsonError_ok;
+}
+
+
+static inline JsonError
+_json_writer_putc(JSON* state, char c) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        if (fputc(c, state->_file) == EOF) { return JsonError_write; }
+        return JsonError_ok;
+    }
+    if (stream->_size == stream->_capacity) {
+        JsonError err = _json_writer_flush_stream(stream);
+        if (err != JsonError_ok) { return err; }
+    }
+    stream->_buffer[stream->_size++] = c;
+    return JsonError_ok;
+}
+
+
+static const char _json_digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+
+static size_t
+_json_format_integer(char* buf, long long value) {
+    char tmp[24];
+    char* p = &tmp[sizeof(tmp)];
+    unsigned long long x = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+    while (x >= 100) {
+        const char* d = &_json_digit_pairs[(x % 100) * 2];
+        x /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (x >= 10) {
+        const char* d = &_json_digit_pairs[x * 2];
+        *--p = d[1];
+        *--p = d[0];
+    }
+    else {
+        *--p = '0' + x;
+    }
+    if (value < 0) {
+        *--p = '-';
+    }
+    size_t n = &tmp[sizeof(tmp)] - p;
+    memcpy(buf, p, n);
+    return n;
+}
+
+
 PVJDEF JsonError
 json_writer_init(JSON* state, FILE* file) {
     state->_file = file;
+    state->_stream = NULL;
     state->_element_count = 0;
     return JsonError_ok;
 }
 
 
+PVJDEF JsonError
+json_writer_init_buffered(JSON* state, JsonStream* stream, FILE* file, size_t buf_size, void* buf) {
+    if (buf == NULL) {
+        buf_size = JsonStream_default_size;
+        buf = malloc(buf_size);
+        if (buf == NULL) {
+            return JsonError_bufsize;
+        }
+        stream->_owns_buffer = 1;
+    }
+    else if (buf_size == 0) {
+        return JsonError_bufsize;
+    }
+    else {
+        stream->_owns_buffer = 0;
+    }
+    stream->_file = file;
+    stream->_buffer = buf;
+    stream->_capacity = buf_size;
+    stream->_position = 0;
+    stream->_size = 0;
+    JsonError err = json_writer_init(state, file);
+    state->_stream = stream;
+    return err;
+}
+
+
+PVJDEF JsonError
+json_writer_flush(JSON* state) {
+    if (state->_stream == NULL) {
+        return JsonError_ok;
+    }
+    return _json_writer_flush_stream(state->_stream);
+}
+
+
+PVJDEF JsonError
+json_writer_close(JSON* state) {
+    JsonStream* stream = state->_stream;
+    if (stream == NULL) {
+        return JsonError_ok;
+    }
+    JsonError err = _json_writer_flush_stream(stream);
+    if (stream->_owns_buffer != 0) {
+        free(stream->_buffer);
+    }
+    *stream = (JsonStream) {};
+    state->_stream = NULL;
+    return err;
+}
+
+
+static JsonError
+_json_writer_init_nested(JSON* state, JSON* nested) {
+    JsonError err = json_writer_init(nested, state->_file);
+    nested->_stream = state->_stream;
+    return err;
+}
+
+
 PVJDEF JsonError
 json_writer_open_object(JSON* state, JSON* object) {
-    FILE* fp = state->_file;
-    if (fputc('{', fp) == EOF) { return JsonError_write; }
-    JsonError err = json_writer_init(object, fp);
+    JsonError err = _json_writer_putc(state, '{');
+    if (err != JsonError_ok) { return err; }
+    err = _json_writer_init_nested(state, object);
     return err;
 }
 
 
 PVJDEF JsonError
 json_writer_close_object(JSON* state) {
-    FILE* fp = state->_file;
-    if (fputc('}', fp) == EOF) { return JsonError_write; }
-    return JsonError_ok;
+    return _json_writer_putc(state, '}');
 }
 
 
 PVJDEF JsonError
 json_writer_write_object_key_separator(JSON* state) {
-    FILE* fp = state->_file;
-    if (fputc(':', fp) == EOF) { return JsonError_write; }
-    return JsonError_ok;
+    return _json_writer_putc(state, ':');
 }
 
 
 PVJDEF JsonError
 json_writer_write_object_value_separator(JSON* state) {
     if (state->_element_count++ != 0) {
-        FILE* fp = state->_file;
-        if (fputc(',', fp) == EOF) { return JsonError_write; }
+        return _json_writer_putc(state, ',');
     }
     return JsonError_ok;
 }
@@ -1286,26 +1761,23 @@ json_writer_write_object_value_separator(JSON* state) {
 
 PVJDEF JsonError
 json_writer_open_array(JSON* state, JSON* array) {
-    FILE* fp = state->_file;
-    if (fputc('[', fp) == EOF) { return JsonError_write; }
-    JsonError err = json_writer_init(array, fp);
+    JsonError err = _json_writer_putc(state, '[');
+    if (err != JsonError_ok) { return err; }
+    err = _json_writer_init_nested(state, array);
     return err;
 }
 
 
 PVJDEF JsonError
 json_writer_close_array(JSON* state) {
-    FILE* fp = state->_file;
-    if (fputc(']', fp) == EOF) { return JsonError_write; }
-    return JsonError_ok;
+    return _json_writer_putc(state, ']');
 }
 
 
 PVJDEF JsonError
 json_writer_write_array_value_separator(JSON* state) {
     if (state->_element_count++ != 0) {
-        FILE* fp = state->_file;
-        if (fputc(',', fp) == EOF) { return JsonError_write; }
+        return _json_writer_putc(state, ',');
     }
     return JsonError_ok;
 }
@@ -1313,118 +1785,138 @@ json_writer_write_array_value_separator(JSON* state) {
 
 PVJDEF JsonError
 json_writer_write_numberi(JSON* state, int value) {
-    int n = fprintf(state->_file, "%d", value);
-    if (n < 0) { return JsonError_write; }
-    return JsonError_ok;
+    char buf[24];
+    size_t n = _json_format_integer(buf, value);
+    return _json_writer_write(state, buf, n);
 }
 
 
 PVJDEF JsonError
 json_writer_write_numberl(JSON* state, long value) {
-    int n = fprintf(state->_file, "%ld", value);
-    if (n < 0) { return JsonError_write; }
-    return JsonError_ok;
+    char buf[24];
+    size_t n = _json_format_integer(buf, value);
+    return _json_writer_write(state, buf, n);
 }
 
 
 PVJDEF JsonError
 json_writer_write_numberll(JSON* state, long long value) {
-    int n = fprintf(state->_file, "%lld", value);
-    if (n < 0) { return JsonError_write; }
-    return JsonError_ok;
+    char buf[24];
+    size_t n = _json_format_integer(buf, value);
+    return _json_writer_write(state, buf, n);
 }
 
 
 PVJDEF JsonError
 json_writer_write_numberf(JSON* state, float value) {
-    int n = fprintf(state->_file, "%.7g", value);
-    if (n < 0) { return JsonError_write; }
-    return JsonError_ok;
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%.7g", value);
+    if (n < 0 || n >= (int)sizeof(buf)) { return JsonError_write; }
+    return _json_writer_write(state, buf, n);
 }
 
 
 PVJDEF JsonError
 json_writer_write_numberd(JSON* state, double value) {
-    int n = fprintf(state->_file, "%.16g", value);
-    if (n < 0) { return JsonError_write; }
-    return JsonError_ok;
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%.16g", value);
+    if (n < 0 || n >= (int)sizeof(buf)) { return JsonError_write; }
+    return _json_writer_write(state, buf, n);
 }
 
 
 PVJDEF JsonError
 json_writer_write_numberld(JSON* state, long double value) {
-    int n = fprintf(state->_file, "%.34Lg", value);
-    if (n < 0) { return JsonError_write; }
-    return JsonError_ok;
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%.34Lg", value);
+    if (n < 0 || n >= (int)sizeof(buf)) { return JsonError_write; }
+    return _json_writer_write(state, buf, n);
+}
+
+
+PVJDEF JsonError
+json_writer_write_int_array(JSON* state, JsonIntType type, const void* buf, size_t count) {
+    char chunk[512];
+    size_t size = 0;
+    chunk[size++] = '[';
+    for (size_t i = 0; i < count; ++i) {
+        long long x;
+        switch (type) {
+            case JsonIntType_i8: x = ((const int8_t*)buf)[i]; break;
+            case JsonIntType_u8: x = ((const uint8_t*)buf)[i]; break;
+            case JsonIntType_i16: x = ((const int16_t*)buf)[i]; break;
+            case JsonIntType_u16: x = ((const uint16_t*)buf)[i]; break;
+            case JsonIntType_i32: x = ((const int32_t*)buf)[i]; break;
+            case JsonIntType_i64: x = ((const int64_t*)buf)[i]; break;
+            default:
+                return JsonError_type_mismatch;
+        }
+        if (size > sizeof(chunk) - 24) {
+            JsonError err = _json_writer_write(state, chunk, size);
+            if (err != JsonError_ok) { return err; }
+            size = 0;
+        }
+        if (i != 0) {
+            chunk[size++] = ',';
+        }
+        size += _json_format_integer(&chunk[size], x);
+    }
+    chunk[size++] = ']';
+    return _json_writer_write(state, chunk, size);
 }
 
 
 PVJDEF JsonError
 json_writer_write_string(JSON* state, const char* value) {
-    FILE* fp = state->_file;
     const char* p = value;
-    if (fputc('"', fp) == EOF) { return JsonError_write; }
+    if (_json_writer_putc(state, '"') != JsonError_ok) { return JsonError_write; }
     for (;; ++p) {
         char c = *p;
         if (c == '\0') { break; }
         switch (c) {
             case '\b':
-                fputc('\\', fp);
-                fputc('b', fp);
+                _json_writer_write(state, "\\b", 2);
                 break;
             case '\t':
-                fputc('\\', fp);
-                fputc('t', fp);
+                _json_writer_write(state, "\\t", 2);
                 break;
             case '\n':
-                fputc('\\', fp);
-                fputc('n', fp);
+                _json_writer_write(state, "\\n", 2);
                 break;
             case '\f':
-                fputc('\\', fp);
-                fputc('f', fp);
+                _json_writer_write(state, "\\f", 2);
                 break;
             case '\r':
-                fputc('\\', fp);
-                fputc('r', fp);
+                _json_writer_write(state, "\\r", 2);
                 break;
             case '"':
-                fputc('\\', fp);
-                fputc('"', fp);
+                _json_writer_write(state, "\\\"", 2);
                 break;
             case '\\':
-                fputc('\\', fp);
-                fputc('\\', fp);
+                _json_writer_write(state, "\\\\", 2);
                 break;
             default:
-                fputc(c, fp);
+                _json_writer_putc(state, c);
                 break;
         }
     }
-    if (fputc('"', fp) == EOF) { return JsonError_write; }
+    if (_json_writer_putc(state, '"') != JsonError_ok) { return JsonError_write; }
     return JsonError_ok;
 }
 
 
 PVJDEF JsonError
 json_writer_write_bool(JSON* state, int value) {
-    size_t n;
     if (value == 0) {
-        n = fwrite("false", 5, 1, state->_file);
-    }
-    else {
-        n = fwrite("true", 4, 1, state->_file);
+        return _json_writer_write(state, "false", 5);
     }
-    if (n != 1) { return JsonError_write; }
-    return JsonError_ok;
+    return _json_writer_write(state, "true", 4);
 }
 
 
 PVJDEF JsonError
 json_writer_write_null(JSON* state) {
-    size_t n = fwrite("null", 4, 1, state->_file);
-    if (n != 1) { return JsonError_write; }
-    return JsonError_ok;
+    return _json_writer_write(state, "null", 4);
 }
 
 
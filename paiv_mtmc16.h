@@ -12,6 +12,8 @@ extern "C" {
 
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int8_t i8;
 typedef int16_t i16;
 
@@ -33,6 +35,11 @@ enum MtmcEmuStatus {
     MtmcEmuStatus_EXECUTING,
     MtmcEmuStatus_PERMANENT_ERROR,
     MtmcEmuStatus_FINISHED,
+    MtmcEmuStatus_INSTRUCTION_LIMIT,
+    MtmcEmuStatus_TIME_LIMIT,
+    MtmcEmuStatus_SYSCALL_LIMIT,
+    MtmcEmuStatus_OUTPUT_LIMIT,
+    MtmcEmuStatus_OUTPUT_MISMATCH,
 };
 
 
@@ -97,13 +104,100 @@ enum MtosSysCall {
 typedef struct Platform* PlatformState;
 
 
+struct MtmcEmu;
+
+typedef void (*MtosSysCallHandler)(struct MtmcEmu* emu, i16 number);
+
+
+enum MtosSysCallFlag {
+    /* may wait on the host */
+    MtosSysCallFlag_blocking = 1 << 0,
+    /* touches the window */
+    MtosSysCallFlag_display = 1 << 1,
+    /* only reads and writes emulator state */
+    MtosSysCallFlag_pure = 1 << 2,
+    /* writes console output */
+    MtosSysCallFlag_output = 1 << 3,
+    /* may be spun on in a busy-wait loop */
+    MtosSysCallFlag_poll = 1 << 4,
+    /* result depends on the host, logged by record and replay */
+    MtosSysCallFlag_input = 1 << 5,
+    /* writes guest memory */
+    MtosSysCallFlag_memory = 1 << 6,
+    /* changes host state, run again on replay under the logged result */
+    MtosSysCallFlag_effect = 1 << 7,
+};
+
+
+struct MtosSysCallEntry {
+    MtosSysCallHandler handler;
+    u8 flags;
+};
+
+
+struct MtosSysCallTable {
+    struct MtosSysCallEntry entries[256];
+};
+
+
+extern const struct MtosSysCallTable MtosDefaultSysCalls;
+
+
+struct MtmcBudget {
+    size_t instructions;
+    size_t milliseconds;
+    size_t syscalls;
+    /* console output bytes */
+    size_t output;
+};
+
+
+/* xoshiro128++ */
+struct MtmcRandom {
+    u32 state[4];
+};
+
+
+struct MtmcRunOptions {
+    int speed;
+    int trace_level;
+    int virtual_clock;
+    u64 seed;
+    FILE* record;
+    FILE* replay;
+    struct MtmcBudget budget;
+};
+
+
 struct MtmcEmu {
     enum MtmcEmuStatus status;
     PlatformState platform;
+    /* defaults to MtosDefaultSysCalls */
+    const struct MtosSysCallTable* syscalls;
     size_t speed;
     int trace_level;
-    size_t graphics_count;
-    struct MtmcGraphic* graphics;
+    /* checked by MtmcRun once per pulse, zero is unlimited */
+    struct MtmcBudget budget;
+    struct MtmcBudget usage;
+    /* timer and sleep follow retired instructions at speed */
+    int virtual_clock;
+    /* retired instructions, and cycles skipped by virtual sleep */
+    size_t clock;
+    size_t clock_skew;
+    size_t timer;
+    /* last polling syscall, to detect busy-wait loops */
+    i16 poll_pc;
+    size_t poll_clock;
+    size_t poll_stores;
+    i16 poll_registers[_total_registers];
+    /* memory writes by instructions */
+    size_t stores;
+    struct MtmcRandom random;
+    /* session logs of input syscalls */
+    FILE* record;
+    FILE* replay;
+    size_t session_clock;
+    const struct MtmcSpriteAtlas* graphics;
     i16 registerFile[_total_registers];
     u8 memory[Mtmc_MEMORY_SIZE];
 };
@@ -129,14 +223,36 @@ struct MtmcGraphic {
 };
 
 
+struct MtmcSprite {
+    i16 width;
+    i16 height;
+    /* bytes per row, 0 mask stride if sprite is opaque */
+    u16 mask_stride;
+    u16 data_stride;
+    /* offsets into atlas pixels */
+    u32 mask_offset;
+    u32 data_offset;
+};
+
+
+struct MtmcSpriteAtlas {
+    size_t count;
+    struct MtmcSprite sprites[MtmcGraphics_max];
+    size_t size;
+    size_t capacity;
+    u8* pixels;
+};
+
+
 struct MtmcExecutable {
     enum MtmcExecutableFormat format;
     size_t codesize;
-    u8 code[Mtmc_MEMORY_SIZE];
+    const u8* code;
     size_t datasize;
-    u8 data[Mtmc_MEMORY_SIZE];
-    size_t graphics_count;
-    struct MtmcGraphic graphics[MtmcGraphics_max];
+    const u8* data;
+    struct MtmcSpriteAtlas graphics;
+    /* code and data of a loaded file, sized to the content */
+    u8* arena;
 };
 
 
@@ -150,6 +266,7 @@ void MtmcWriteByteToMemory(struct MtmcEmu* emu, i16 addr, u8 value);
 
 i16 MtmcFetchWordFromMemory(struct MtmcEmu* emu, i16 addr);
 void MtmcWriteWordToMemory(struct MtmcEmu* emu, i16 addr, i16 value);
+void MtmcCopyMemory(struct MtmcEmu* emu, i16 source, i16 target, i16 size);
 
 u8 MtmcIsFlagTestBitSet(struct MtmcEmu* emu);
 void MtmcSetFlagTestBit(struct MtmcEmu* emu, u8 value);
@@ -157,17 +274,33 @@ void MtmcSetFlagOverflowBit(struct MtmcEmu* emu, u8 value);
 
 void MtmcExecInstruction(struct MtmcEmu* emu, i16 instr);
 
+void MtmcRandomSeed(struct MtmcRandom* random, u64 seed);
+u32 MtmcRandomNext(struct MtmcRandom* random);
+i16 MtmcRandomRange(struct MtmcRandom* random, i16 start, i16 stop);
+
 void MtmcInitMemory(struct MtmcEmu* emu);
 void MtmcLoad(struct MtmcEmu* emu, struct MtmcExecutable* exe);
 void MtmcSetArg(struct MtmcEmu* emu, const char* arg);
 int MtmcRun(struct MtmcEmu* emu);
 int MtmcPulse(struct MtmcEmu* emu, int pulse);
+
+int MtmcSetRecord(struct MtmcEmu* emu, FILE* file);
+int MtmcSetReplay(struct MtmcEmu* emu, FILE* file);
+
+void MtosSysCallTableInit(struct MtosSysCallTable* table);
+void MtosSysCallRegister(struct MtosSysCallTable* table, u8 number,
+    MtosSysCallHandler handler, u8 flags);
 int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe);
+void MtmcExecutableDeinit(struct MtmcExecutable* exe);
 
 int MtmcGraphicLoad(struct MtmcGraphic* graphic, FILE* file);
 int MtmcGraphicWrite(struct MtmcGraphic* graphic, FILE* file);
 int MtmcGraphicHasAlpha(struct MtmcGraphic* graphic);
 
+int MtmcSpriteAtlasAppend(struct MtmcSpriteAtlas* atlas, struct MtmcGraphic* graphic);
+void MtmcSpriteAtlasGetGraphic(const struct MtmcSpriteAtlas* atlas, size_t index, struct MtmcGraphic* graphic);
+void MtmcSpriteAtlasDeinit(struct MtmcSpriteAtlas* atlas);
+
 
 #if defined(EXIT_FAILURE)
 #define FatalError() abort()
@@ -193,7 +326,9 @@ int MtmcGraphicHasAlpha(struct MtmcGraphic* graphic);
 #include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 int PlatformInit(PlatformState state);
@@ -204,17 +339,22 @@ void PlatformResetFrame(PlatformState state);
 void PlatformDrawFrame(PlatformState state);
 void PlatformSetColor(PlatformState state, i16 color);
 void PlatformFillRect(PlatformState state, i16 x, i16 y, i16 width, i16 height);
-void PlatformDrawImage(PlatformState state, struct MtmcGraphic* image, i16 x, i16 y);
+void PlatformDrawImage(PlatformState state, const struct MtmcSpriteAtlas* atlas, i16 index, i16 x, i16 y);
 i16 PlatformGetJoystick(PlatformState state);
 char PlatformGetChar(PlatformState state);
+i16 PlatformReadString(PlatformState state, char* buf, i16 bufsize);
 void PlatformPutChar(PlatformState state, char c);
 void PlatformPutString(PlatformState state, const char* s);
+void PlatformPutBuffer(PlatformState state, const char* s, size_t size);
+size_t PlatformGetOutputCount(PlatformState state);
+int PlatformCheckOutput(PlatformState state, int complete, size_t* offset);
 void PlatformPutWord(PlatformState state, i16 n);
 i16 PlatformReadWord(PlatformState state);
 i16 PlatformParseWord(PlatformState state, const char* s);
-i16 PlatformRandom(PlatformState state, i16 start, i16 stop);
 i16 PlatformSetTimer(PlatformState state, i16 millis);
 i16 PlatformFileRead(PlatformState state, const char* filename, u8* buf, i16 bufsize, i16 maxlines);
+i16 PlatformFileWrite(PlatformState state, const char* filename, const u8* buf, i16 size);
+i16 PlatformFileDelete(PlatformState state, const char* filename);
 i16 PlatformGetCurrentDir(PlatformState state, char* buf, size_t bufsize);
 i16 PlatformSetCurrentDir(PlatformState state, const char* name);
 i16 PlatformDirGetSize(PlatformState state, const char* name);
@@ -240,6 +380,78 @@ int MtmcGraphicHasAlpha(struct MtmcGraphic* graphic) {
 }
 
 
+int MtmcSpriteAtlasAppend(struct MtmcSpriteAtlas* atlas, struct MtmcGraphic* graphic) {
+    if (atlas->count >= MtmcGraphics_max) { return 1; }
+    struct MtmcSprite* sprite = &atlas->sprites[atlas->count];
+    *sprite = (struct MtmcSprite) {};
+    if (graphic != NULL) {
+        sprite->width = graphic->width;
+        sprite->height = graphic->height;
+        if (MtmcGraphicHasAlpha(graphic) != 0) {
+            sprite->mask_stride = (graphic->width + 7) / 8;
+        }
+        sprite->data_stride = (graphic->width + 3) / 4;
+    }
+
+    size_t masksize = (size_t)sprite->mask_stride * sprite->height;
+    size_t datasize = (size_t)sprite->data_stride * sprite->height;
+    size_t size = atlas->size + masksize + datasize;
+    if (size > atlas->capacity) {
+        size_t capacity = atlas->capacity > 0 ? atlas->capacity : 4096;
+        while (capacity < size) { capacity *= 2; }
+        u8* pixels = realloc(atlas->pixels, capacity);
+        if (pixels == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        atlas->pixels = pixels;
+        atlas->capacity = capacity;
+    }
+
+    sprite->mask_offset = atlas->size;
+    sprite->data_offset = atlas->size + masksize;
+    if (masksize > 0) {
+        memcpy(&atlas->pixels[sprite->mask_offset], graphic->mask, masksize);
+    }
+    if (datasize > 0) {
+        memcpy(&atlas->pixels[sprite->data_offset], graphic->data, datasize);
+    }
+    atlas->size = size;
+    atlas->count += 1;
+    return 0;
+}
+
+
+void MtmcSpriteAtlasGetGraphic(const struct MtmcSpriteAtlas* atlas, size_t index,
+    struct MtmcGraphic* graphic) {
+    const struct MtmcSprite* sprite = &atlas->sprites[index];
+    *graphic = (struct MtmcGraphic) {};
+    graphic->width = sprite->width;
+    graphic->height = sprite->height;
+    size_t masksize = (size_t)sprite->mask_stride * sprite->height;
+    size_t datasize = (size_t)sprite->data_stride * sprite->height;
+    if (masksize > 0) {
+        memcpy(graphic->mask, &atlas->pixels[sprite->mask_offset], masksize);
+    }
+    if (datasize > 0) {
+        memcpy(graphic->data, &atlas->pixels[sprite->data_offset], datasize);
+    }
+}
+
+
+void MtmcSpriteAtlasDeinit(struct MtmcSpriteAtlas* atlas) {
+    free(atlas->pixels);
+    *atlas = (struct MtmcSpriteAtlas) {};
+}
+
+
+void MtmcExecutableDeinit(struct MtmcExecutable* exe) {
+    MtmcSpriteAtlasDeinit(&exe->graphics);
+    free(exe->arena);
+    *exe = (struct MtmcExecutable) {};
+}
+
+
 enum MtmcDirentCommand {
     MtmcDirent_count = 0x00,
     MtmcDirent_get_entry = 0x01,
@@ -264,6 +476,7 @@ void MtmcSetErrorStatus(struct MtmcEmu* emu, enum MtmcEmuStatus status,
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     va_end(args);
+    fputc('\n', stderr);
 }
 
 
@@ -305,6 +518,7 @@ u8 MtmcFetchByteFromMemory(struct MtmcEmu* emu, i16 addr) {
 void MtmcWriteByteToMemory(struct MtmcEmu* emu, i16 addr, u8 value) {
     if (addr >= 0 && addr < (i16)sizeof(emu->memory)) {
         emu->memory[addr] = value;
+        emu->stores += 1;
     }
     else {
         MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
@@ -326,6 +540,26 @@ void MtmcWriteWordToMemory(struct MtmcEmu* emu, i16 addr, i16 value) {
 }
 
 
+/* Copies as if through a temporary buffer, so overlapping ranges
+   end up with the original source bytes. */
+void MtmcCopyMemory(struct MtmcEmu* emu, i16 source, i16 target, i16 size) {
+    if (size <= 0) { return; }
+    int limit = sizeof(emu->memory) - size;
+    if (source < 0 || source > limit) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "bad memory range on copy: %d (0x%04x) size %d", source, (u16)source, size);
+        return;
+    }
+    if (target < 0 || target > limit) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "bad memory range on copy: %d (0x%04x) size %d", target, (u16)target, size);
+        return;
+    }
+    memmove(&emu->memory[target], &emu->memory[source], size);
+    emu->stores += 1;
+}
+
+
 u8 MtmcIsFlagTestBitSet(struct MtmcEmu* emu) {
     i16 value = MtmcGetRegisterValue(emu, FLAGS);
     u8 flag = value & 1;
@@ -349,6 +583,54 @@ void MtmcSetFlagOverflowBit(struct MtmcEmu* emu, u8 value) {
 }
 
 
+/* Seeds through splitmix64, which never yields the all-zero state. */
+void MtmcRandomSeed(struct MtmcRandom* random, u64 seed) {
+    for (size_t i = 0; i < 4; i += 2) {
+        seed += 0x9E3779B97F4A7C15;
+        u64 z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        z = z ^ (z >> 31);
+        random->state[i] = (u32)z;
+        random->state[i + 1] = (u32)(z >> 32);
+    }
+}
+
+
+static inline u32 _MtmcRotl(u32 x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+
+u32 MtmcRandomNext(struct MtmcRandom* random) {
+    u32* s = random->state;
+    u32 res = _MtmcRotl(s[0] + s[3], 7) + s[0];
+    u32 t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = _MtmcRotl(s[3], 11);
+    return res;
+}
+
+
+/* Uniform in [start, stop], by Lemire's multiply and reject. */
+i16 MtmcRandomRange(struct MtmcRandom* random, i16 start, i16 stop) {
+    if (start > stop) { return start; }
+    u32 range = (u32)((int)stop - start) + 1;
+    u64 m = (u64)MtmcRandomNext(random) * range;
+    if ((u32)m < range) {
+        u32 threshold = -range % range;
+        while ((u32)m < threshold) {
+            m = (u64)MtmcRandomNext(random) * range;
+        }
+    }
+    return start + (i16)(m >> 32);
+}
+
+
 void MtmcInitMemory(struct MtmcEmu* emu) {
     memset(emu->memory, 0, sizeof(emu->memory));
     MtmcSetRegisterValue(emu, SP, Mtmc_MEMORY_SIZE);
@@ -356,15 +638,17 @@ void MtmcInitMemory(struct MtmcEmu* emu) {
 
 
 void MtmcLoad(struct MtmcEmu* emu, struct MtmcExecutable* exe) {
-    emu->graphics_count = exe->graphics_count;
-    emu->graphics = &exe->graphics[0];
+    emu->graphics = &exe->graphics;
+    MtmcRandomSeed(&emu->random, 0);
     MtmcInitMemory(emu);
 
     size_t boundary = exe->codesize;
     if (boundary > sizeof(emu->memory)) {
         boundary = sizeof(emu->memory);
     }
-    memcpy(emu->memory, exe->code, boundary);
+    if (boundary > 0) {
+        memcpy(emu->memory, exe->code, boundary);
+    }
 
     size_t datasize = exe->datasize;
     if (boundary + datasize > sizeof(emu->memory)) {
@@ -372,7 +656,9 @@ void MtmcLoad(struct MtmcEmu* emu, struct MtmcExecutable* exe) {
     }
     size_t total = boundary + datasize;
 
-    memcpy(&emu->memory[boundary], exe->data, datasize);
+    if (datasize > 0) {
+        memcpy(&emu->memory[boundary], exe->data, datasize);
+    }
 
     MtmcSetRegisterValue(emu, CB, boundary - 1);
     MtmcSetRegisterValue(emu, DB, total - 1);
@@ -531,7 +817,10 @@ void MtmcExecInstruction(struct MtmcEmu* emu, i16 instr) {
                     break;
 
                 case MtmcInstructionMisc_mcp:
-                    FatalError();
+                    MtmcCopyMemory(emu,
+                        MtmcGetRegisterValue(emu, NIB1(instr)),
+                        MtmcGetRegisterValue(emu, NIB0(instr)),
+                        MtmcGetRegisterValue(emu, DR));
                     break;
 
                 case MtmcInstructionMisc_debug:
@@ -1056,6 +1345,7 @@ void _MtmcFetchAndExecute(struct MtmcEmu* emu) {
     MtmcSetRegisterValue(emu, PC,
         MtmcGetRegisterValue(emu, PC) + offset);
     MtmcExecInstruction(emu, instr);
+    emu->clock += 1;
 }
 
 
@@ -1064,10 +1354,60 @@ int MtmcPulse(struct MtmcEmu* emu, int pulse) {
     for (; count < pulse && MtmcGetStatus(emu) == MtmcEmuStatus_EXECUTING; ++count) {
         _MtmcFetchAndExecute(emu);
     }
+    emu->usage.instructions += count;
     return count;
 }
 
 
+static size_t _MtmcClockMillis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (size_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static void _MtmcCheckBudget(struct MtmcEmu* emu, size_t start, size_t output) {
+    const struct MtmcBudget* budget = &emu->budget;
+    struct MtmcBudget* usage = &emu->usage;
+    usage->milliseconds = _MtmcClockMillis() - start;
+    usage->output = PlatformGetOutputCount(emu->platform) - output;
+    if (emu->status != MtmcEmuStatus_EXECUTING) { return; }
+
+    if (budget->instructions != 0 && usage->instructions >= budget->instructions) {
+        emu->status = MtmcEmuStatus_INSTRUCTION_LIMIT;
+    }
+    else if (budget->milliseconds != 0 && usage->milliseconds >= budget->milliseconds) {
+        emu->status = MtmcEmuStatus_TIME_LIMIT;
+    }
+    else if (budget->syscalls != 0 && usage->syscalls >= budget->syscalls) {
+        emu->status = MtmcEmuStatus_SYSCALL_LIMIT;
+    }
+    else if (budget->output != 0 && usage->output >= budget->output) {
+        emu->status = MtmcEmuStatus_OUTPUT_LIMIT;
+    }
+}
+
+
+static const char* _MtmcStatusLimitName(enum MtmcEmuStatus status) {
+    switch (status) {
+        case MtmcEmuStatus_INSTRUCTION_LIMIT: return "instruction";
+        case MtmcEmuStatus_TIME_LIMIT: return "time";
+        case MtmcEmuStatus_SYSCALL_LIMIT: return "syscall";
+        case MtmcEmuStatus_OUTPUT_LIMIT: return "output";
+        default: return NULL;
+    }
+}
+
+
+static void _MtmcCheckOutput(struct MtmcEmu* emu, int complete, i16 pc) {
+    size_t offset = 0;
+    if (PlatformCheckOutput(emu->platform, complete, &offset) != 0) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_OUTPUT_MISMATCH,
+            "output mismatch at offset %zu, pc %04X", offset, (u16)pc);
+    }
+}
+
+
 int MtmcRun(struct MtmcEmu* emu) {
     if (emu->speed == 0) {
         emu->speed = Mtmc_DEFAULT_SPEED;
@@ -1081,9 +1421,35 @@ int MtmcRun(struct MtmcEmu* emu) {
         fputs("executing:\n", stderr);
     }
 
+    size_t start = _MtmcClockMillis();
+    size_t output = PlatformGetOutputCount(emu->platform);
+    emu->usage = (struct MtmcBudget) {};
+    emu->poll_pc = -1;
+
     while (emu->status == MtmcEmuStatus_EXECUTING) {
-        MtmcPulse(emu, pulse);
-        PlatformSleep(emu->platform, window);
+        size_t count = pulse;
+        if (emu->budget.instructions != 0 &&
+            emu->budget.instructions - emu->usage.instructions < count) {
+            count = emu->budget.instructions - emu->usage.instructions;
+        }
+        MtmcPulse(emu, count);
+        if (emu->virtual_clock == 0) {
+            PlatformSleep(emu->platform, window);
+        }
+        if (emu->status == MtmcEmuStatus_EXECUTING &&
+            PlatformIsClosed(emu->platform) != 0) {
+            emu->status = MtmcEmuStatus_FINISHED;
+        }
+        _MtmcCheckBudget(emu, start, output);
+    }
+
+    if (emu->status == MtmcEmuStatus_FINISHED) {
+        _MtmcCheckOutput(emu, 1, MtmcGetRegisterValue(emu, PC));
+    }
+
+    const char* limit = _MtmcStatusLimitName(emu->status);
+    if (limit != NULL) {
+        fprintf(stderr, "stopped: %s limit exceeded\n", limit);
     }
 
     if (emu->trace_level > 0) {
@@ -1094,287 +1460,717 @@ int MtmcRun(struct MtmcEmu* emu) {
 }
 
 
+static size_t _MtmcFormatWord(char* buf, i16 n) {
+    char digits[6];
+    size_t count = 0;
+    u16 x = n < 0 ? -(u16)n : (u16)n;
+    do {
+        digits[count++] = '0' + x % 10;
+        x /= 10;
+    } while (x != 0);
+    size_t size = 0;
+    if (n < 0) {
+        buf[size++] = '-';
+    }
+    while (count > 0) {
+        buf[size++] = digits[--count];
+    }
+    return size;
+}
+
+
+static const char* _MtmcGuestString(struct MtmcEmu* emu, i16 addr, size_t* size) {
+    *size = 0;
+    if (addr < 0 || addr >= (i16)sizeof(emu->memory)) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "bad string address: %d (0x%04x)", addr, (u16)addr);
+        return NULL;
+    }
+    const u8* p = &emu->memory[addr];
+    size_t n = sizeof(emu->memory) - addr;
+    const u8* end = memchr(p, '\0', n);
+    *size = (end != NULL) ? (size_t)(end - p) : n;
+    return (const char*) p;
+}
+
+
+struct _MtmcPrintBuffer {
+    PlatformState platform;
+    i16 total;
+    size_t size;
+    char data[256];
+};
+
+
+static void _MtmcPrintWrite(struct _MtmcPrintBuffer* out, const char* s, size_t size) {
+    out->total += size;
+    while (size > 0) {
+        if (out->size == sizeof(out->data)) {
+            PlatformPutBuffer(out->platform, out->data, out->size);
+            out->size = 0;
+        }
+        size_t n = sizeof(out->data) - out->size;
+        if (n > size) { n = size; }
+        memcpy(&out->data[out->size], s, n);
+        out->size += n;
+        s += n;
+        size -= n;
+    }
+}
+
+
+/* Arguments are words on the stack, %s takes a string address. */
 i16 MtmcPrintFormat(struct MtmcEmu* emu, i16 addr, i16 stack) {
-    i16 total = 0;
-    int state = 0;
-    u8* p = &emu->memory[addr];
-    for (; *p != '\0';) {
-        u8 c = *p++;
-        switch (state) {
-            case 0:
-                if (c == '%') {
-                    state = 1;
-                }
-                else {
-                    PlatformPutChar(emu->platform, c);
-                    total += 1;
-                }
+    struct _MtmcPrintBuffer out = { .platform = emu->platform };
+    size_t size;
+    const char* p = _MtmcGuestString(emu, addr, &size);
+    if (p == NULL) { return 0; }
+    const char* end = p + size;
+
+    while (p < end) {
+        const char* spec = memchr(p, '%', end - p);
+        if (spec == NULL) {
+            _MtmcPrintWrite(&out, p, end - p);
+            break;
+        }
+        _MtmcPrintWrite(&out, p, spec - p);
+        p = spec + 1;
+        if (p == end) {
+            _MtmcPrintWrite(&out, spec, 1);
+            break;
+        }
+        switch (*p++) {
+            case 'd': {
+                char buf[8];
+                i16 x = MtmcFetchWordFromMemory(emu, stack);
+                stack += 2;
+                _MtmcPrintWrite(&out, buf, _MtmcFormatWord(buf, x));
                 break;
-            case 1:
-                switch (c) {
-                    case 'd':
-                    case 'c':
-                    case 's':
-                        FatalErrorFmt("not implemented: %%%c", c);
-                        break;
-                    default:
-                        PlatformPutChar(emu->platform, '%');
-                        PlatformPutChar(emu->platform, c);
-                        total += 2;
+            }
+            case 'c': {
+                char c = MtmcFetchWordFromMemory(emu, stack);
+                stack += 2;
+                _MtmcPrintWrite(&out, &c, 1);
+                break;
+            }
+            case 's': {
+                i16 x = MtmcFetchWordFromMemory(emu, stack);
+                stack += 2;
+                size_t n;
+                const char* s = _MtmcGuestString(emu, x, &n);
+                if (s != NULL) {
+                    _MtmcPrintWrite(&out, s, n);
                 }
                 break;
+            }
+            default:
+                _MtmcPrintWrite(&out, spec, 2);
         }
     }
-    switch (state) {
-        case 1:
-            PlatformPutChar(emu->platform, '%');
-            total += 1;
+
+    if (out.size > 0) {
+        PlatformPutBuffer(emu->platform, out.data, out.size);
     }
-    return total;
+    return out.total;
 }
 
 
-void MtosHandleSysCall(struct MtmcEmu* emu, i16 number) {
-    switch ((enum MtosSysCall)number) {
-        case MtosSysCall_exit:
-            emu->status = MtmcEmuStatus_FINISHED;
-            break;
+static void _MtosSysExit(struct MtmcEmu* emu, i16 number) {
+    emu->status = MtmcEmuStatus_FINISHED;
+}
 
-        case MtosSysCall_rint: {
-            i16 x = PlatformReadWord(emu->platform);
-            MtmcSetRegisterValue(emu, RV, x);
-            break;
-        }
 
-        case MtosSysCall_wint: {
-            i16 value = MtmcGetRegisterValue(emu, A0);
-            PlatformPutWord(emu->platform, value);
-            break;
-        }
+static void _MtosSysReadInt(struct MtmcEmu* emu, i16 number) {
+    i16 x = PlatformReadWord(emu->platform);
+    MtmcSetRegisterValue(emu, RV, x);
+}
 
-        case MtosSysCall_rstr:
-            FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
-            break;
 
-        case MtosSysCall_wchr: {
-            i16 value = MtmcGetRegisterValue(emu, A0);
-            PlatformPutChar(emu->platform, value);
-            break;
-        }
+static void _MtosSysWriteInt(struct MtmcEmu* emu, i16 number) {
+    i16 value = MtmcGetRegisterValue(emu, A0);
+    PlatformPutWord(emu->platform, value);
+}
 
-        case MtosSysCall_rchr: {
-            u8 c = PlatformGetChar(emu->platform);
-            MtmcSetRegisterValue(emu, RV, c);
-            break;
-        }
 
-        case MtosSysCall_wstr: {
-            i16 addr = MtmcGetRegisterValue(emu, A0);
-            PlatformPutString(emu->platform, (char*)&emu->memory[addr]);
-            break;
-        }
+static void _MtosSysReadString(struct MtmcEmu* emu, i16 number) {
+    i16 addr = MtmcGetRegisterValue(emu, A0);
+    i16 bufsize = MtmcGetRegisterValue(emu, A1);
+    if (addr < 0 || addr >= (i16)sizeof(emu->memory)) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "bad memory address on read string: %d (0x%04x)", addr, (u16)addr);
+        return;
+    }
+    if (bufsize > (i16)sizeof(emu->memory) - addr) {
+        bufsize = sizeof(emu->memory) - addr;
+    }
+    i16 res = PlatformReadString(emu->platform, (char*) &emu->memory[addr], bufsize);
+    MtmcSetRegisterValue(emu, RV, res);
+}
 
-        case MtosSysCall_printf: {
-            i16 addr = MtmcGetRegisterValue(emu, A0);
-            i16 stack = MtmcGetRegisterValue(emu, A1);
-            i16 res = MtmcPrintFormat(emu, addr, stack);
-            MtmcSetRegisterValue(emu, RV, res);
-            break;
-        }
 
-        case MtosSysCall_atoi: {
-            i16 addr = MtmcGetRegisterValue(emu, A0);
-            i16 res = PlatformParseWord(emu->platform, (char*) &emu->memory[addr]);
-            MtmcSetRegisterValue(emu, RV, res);
-            break;
-        }
+static void _MtosSysWriteChar(struct MtmcEmu* emu, i16 number) {
+    i16 value = MtmcGetRegisterValue(emu, A0);
+    PlatformPutChar(emu->platform, value);
+}
 
-        case MtosSysCall_rfile: {
-            i16 fname = MtmcGetRegisterValue(emu, A0);
-            i16 addr = MtmcGetRegisterValue(emu, A1);
-            i16 size = MtmcGetRegisterValue(emu, A2);
-            i16 lines = MtmcGetRegisterValue(emu, A3);
-            i16 res = PlatformFileRead(
-                emu->platform,
-                (char*)&emu->memory[fname],
-                &emu->memory[addr],
-                size, lines);
-            MtmcSetRegisterValue(emu, RV, res);
-            break;
-        }
 
-        case MtosSysCall_wfile:
-            FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
-            break;
+static void _MtosSysReadChar(struct MtmcEmu* emu, i16 number) {
+    u8 c = PlatformGetChar(emu->platform);
+    MtmcSetRegisterValue(emu, RV, c);
+}
 
-        case MtosSysCall_cwd: {
-            i16 addr = MtmcGetRegisterValue(emu, A0);
-            i16 bufsize = MtmcGetRegisterValue(emu, A1);
-            char path[PATH_MAX];
-            int res = PlatformGetCurrentDir(emu->platform, path, sizeof(path));
-            if (res > 0) {
-                res += 1;
-                if (res > bufsize) {
-                    res = bufsize;
-                }
-                for (int i = 0; i < res; ++i) {
-                    MtmcWriteByteToMemory(emu, addr + i, path[i]);
-                }
-            }
-            else {
-                res = 0;
-            }
-            MtmcSetRegisterValue(emu, RV, res);
-            break;
+
+static void _MtosSysWriteString(struct MtmcEmu* emu, i16 number) {
+    i16 addr = MtmcGetRegisterValue(emu, A0);
+    size_t size;
+    const char* s = _MtmcGuestString(emu, addr, &size);
+    if (s != NULL) {
+        PlatformPutBuffer(emu->platform, s, size);
+    }
+}
+
+
+static void _MtosSysPrintf(struct MtmcEmu* emu, i16 number) {
+    i16 addr = MtmcGetRegisterValue(emu, A0);
+    i16 stack = MtmcGetRegisterValue(emu, A1);
+    i16 res = MtmcPrintFormat(emu, addr, stack);
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+static void _MtosSysAtoi(struct MtmcEmu* emu, i16 number) {
+    i16 addr = MtmcGetRegisterValue(emu, A0);
+    i16 res = PlatformParseWord(emu->platform, (char*) &emu->memory[addr]);
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+static void _MtosSysReadFile(struct MtmcEmu* emu, i16 number) {
+    i16 fname = MtmcGetRegisterValue(emu, A0);
+    i16 addr = MtmcGetRegisterValue(emu, A1);
+    i16 size = MtmcGetRegisterValue(emu, A2);
+    i16 lines = MtmcGetRegisterValue(emu, A3);
+    i16 res = PlatformFileRead(
+        emu->platform,
+        (char*)&emu->memory[fname],
+        &emu->memory[addr],
+        size, lines);
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+/* File name in guest memory, which must end before the memory does. */
+static const char* _MtmcGuestFileName(struct MtmcEmu* emu, i16 addr) {
+    size_t size;
+    const char* name = _MtmcGuestString(emu, addr, &size);
+    if (name == NULL) { return NULL; }
+    if (size >= sizeof(emu->memory) - addr) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "unterminated file name: %d (0x%04x)", addr, (u16)addr);
+        return NULL;
+    }
+    return name;
+}
+
+
+static void _MtosSysWriteFile(struct MtmcEmu* emu, i16 number) {
+    const char* fname = _MtmcGuestFileName(emu, MtmcGetRegisterValue(emu, A0));
+    if (fname == NULL) { return; }
+    i16 addr = MtmcGetRegisterValue(emu, A1);
+    i16 size = MtmcGetRegisterValue(emu, A2);
+    if (addr < 0 || size < 0 || size > (i16)sizeof(emu->memory) - addr) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "bad memory range on write file: %d (0x%04x) size %d", addr, (u16)addr, size);
+        return;
+    }
+    i16 res = PlatformFileWrite(
+        emu->platform,
+        fname,
+        &emu->memory[addr],
+        size);
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+static void _MtosSysDeleteFile(struct MtmcEmu* emu, i16 number) {
+    const char* fname = _MtmcGuestFileName(emu, MtmcGetRegisterValue(emu, A0));
+    if (fname == NULL) { return; }
+    i16 res = PlatformFileDelete(emu->platform, fname);
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+static void _MtosSysCurrentDir(struct MtmcEmu* emu, i16 number) {
+    i16 addr = MtmcGetRegisterValue(emu, A0);
+    i16 bufsize = MtmcGetRegisterValue(emu, A1);
+    char path[PATH_MAX];
+    int res = PlatformGetCurrentDir(emu->platform, path, sizeof(path));
+    if (res > 0) {
+        res += 1;
+        if (res > bufsize) {
+            res = bufsize;
         }
+        for (int i = 0; i < res; ++i) {
+            MtmcWriteByteToMemory(emu, addr + i, path[i]);
+        }
+    }
+    else {
+        res = 0;
+    }
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+static void _MtosSysChangeDir(struct MtmcEmu* emu, i16 number) {
+    i16 name = MtmcGetRegisterValue(emu, A0);
+    i16 res = PlatformSetCurrentDir(emu->platform,
+        (char*) &emu->memory[name]);
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
 
-        case MtosSysCall_chdir: {
-            i16 name = MtmcGetRegisterValue(emu, A0);
-            i16 res = PlatformSetCurrentDir(emu->platform,
+static void _MtosSysDirent(struct MtmcEmu* emu, i16 number) {
+    i16 name = MtmcGetRegisterValue(emu, A0);
+    i16 cmd = MtmcGetRegisterValue(emu, A1);
+    switch ((enum MtmcDirentCommand)cmd) {
+        case MtmcDirent_count: {
+            i16 size = PlatformDirGetSize(emu->platform,
                 (char*) &emu->memory[name]);
-            MtmcSetRegisterValue(emu, RV, res);
+            MtmcSetRegisterValue(emu, RV, size);
             break;
         }
-
-        case MtosSysCall_dirent: {
-            i16 name = MtmcGetRegisterValue(emu, A0);
-            i16 cmd = MtmcGetRegisterValue(emu, A1);
-            switch ((enum MtmcDirentCommand)cmd) {
-                case MtmcDirent_count: {
-                    i16 size = PlatformDirGetSize(emu->platform,
-                        (char*) &emu->memory[name]);
-                    MtmcSetRegisterValue(emu, RV, size);
-                    break;
-                }
-                case MtmcDirent_get_entry: {
-                    i16 i = MtmcGetRegisterValue(emu, A2);
-                    i16 addr = MtmcGetRegisterValue(emu, A3);
-                    i16 bufsize = MtmcFetchWordFromMemory(emu, addr + 2);
-                    char* buf = (char*) &emu->memory[addr + 4];
-                    i16 flags = 0;
-                    i16 res = PlatformDirReadEntry(emu->platform,
-                        (char*) &emu->memory[name], i, &flags, buf, bufsize);
-                    MtmcWriteWordToMemory(emu, addr, flags);
-                    MtmcSetRegisterValue(emu, RV, res);
-                    break;
-                }
-            }
+        case MtmcDirent_get_entry: {
+            i16 i = MtmcGetRegisterValue(emu, A2);
+            i16 addr = MtmcGetRegisterValue(emu, A3);
+            i16 bufsize = MtmcFetchWordFromMemory(emu, addr + 2);
+            char* buf = (char*) &emu->memory[addr + 4];
+            i16 flags = 0;
+            i16 res = PlatformDirReadEntry(emu->platform,
+                (char*) &emu->memory[name], i, &flags, buf, bufsize);
+            MtmcWriteWordToMemory(emu, addr, flags);
+            MtmcSetRegisterValue(emu, RV, res);
             break;
         }
+    }
+}
 
-        case MtosSysCall_dfile:
-            FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
-            break;
 
-        case MtosSysCall_rnd: {
-            i16 start = MtmcGetRegisterValue(emu, A0);
-            i16 stop = MtmcGetRegisterValue(emu, A1);
-            if (start > stop) {
-                i16 t = stop;
-                stop = start;
-                start = t;
-            }
-            i16 x = PlatformRandom(emu->platform, start, stop + 1);
-            MtmcSetRegisterValue(emu, RV, x);
-            break;
-        }
+static void _MtosSysRandom(struct MtmcEmu* emu, i16 number) {
+    i16 start = MtmcGetRegisterValue(emu, A0);
+    i16 stop = MtmcGetRegisterValue(emu, A1);
+    if (start > stop) {
+        i16 t = stop;
+        stop = start;
+        start = t;
+    }
+    i16 x = MtmcRandomRange(&emu->random, start, stop);
+    MtmcSetRegisterValue(emu, RV, x);
+}
 
-        case MtosSysCall_sleep:
-            PlatformSleep(emu->platform,
-                MtmcGetRegisterValue(emu, A0));
-            break;
 
-        case MtosSysCall_timer: {
-            i16 t = MtmcGetRegisterValue(emu, A0);
-            i16 x = PlatformSetTimer(emu->platform, t);
-            MtmcSetRegisterValue(emu, RV, x);
-            break;
-        }
+static size_t _MtmcVirtualMillis(struct MtmcEmu* emu) {
+    size_t speed = emu->speed != 0 ? emu->speed : Mtmc_DEFAULT_SPEED;
+    size_t cycles = emu->clock + emu->clock_skew;
+    return cycles / speed * 1000 + cycles % speed * 1000 / speed;
+}
 
-        case MtosSysCall_fbreset:
-            PlatformResetFrame(emu->platform);
-            break;
 
-        case MtosSysCall_fbstat:
-        case MtosSysCall_fbset:
-        case MtosSysCall_fbline:
-            FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
-            break;
+enum {
+    /* instructions between polls of a busy-wait loop */
+    _MtmcPollLoopLength = 8,
+    _MtmcIdleMillis = 10,
+};
 
-        case MtosSysCall_fbrect:
-            PlatformFillRect(emu->platform,
-                MtmcGetRegisterValue(emu, A0),
-                MtmcGetRegisterValue(emu, A1),
-                MtmcGetRegisterValue(emu, A2),
-                MtmcGetRegisterValue(emu, A3)
-            );
-            break;
 
-        case MtosSysCall_fbflush:
-            PlatformDrawFrame(emu->platform);
-            break;
+/* The same polling syscall again from the same PC, a few instructions
+   later, with no other syscall, no memory store, and no register but RV
+   changed in between, is a busy-wait loop doing nothing but polling. */
+static int _MtmcIsBusyWait(struct MtmcEmu* emu) {
+    i16 pc = MtmcGetRegisterValue(emu, PC);
+    i16 registers[_total_registers];
+    memcpy(registers, emu->registerFile, sizeof(registers));
+    registers[RV] = 0;
+    int busy = (pc == emu->poll_pc &&
+        emu->clock - emu->poll_clock <= _MtmcPollLoopLength &&
+        emu->stores == emu->poll_stores &&
+        memcmp(registers, emu->poll_registers, sizeof(registers)) == 0);
+    emu->poll_pc = pc;
+    emu->poll_clock = emu->clock;
+    emu->poll_stores = emu->stores;
+    memcpy(emu->poll_registers, registers, sizeof(registers));
+    return busy;
+}
 
-        case MtosSysCall_joystick: {
-            i16 state = PlatformGetJoystick(emu->platform);
-            MtmcSetRegisterValue(emu, IO, state);
-            MtmcSetRegisterValue(emu, RV, MtmcGetRegisterValue(emu, IO));
-            break;
-        }
 
-        case MtosSysCall_scolor: {
-            i16 c = MtmcGetRegisterValue(emu, A0);
-            PlatformSetColor(emu->platform, c);
-            break;
+static void _MtmcSleep(struct MtmcEmu* emu, i16 millis) {
+    if (emu->virtual_clock != 0) {
+        size_t speed = emu->speed != 0 ? emu->speed : Mtmc_DEFAULT_SPEED;
+        if (millis > 0) {
+            emu->clock_skew += (size_t)millis * speed / 1000;
         }
+        return;
+    }
+    PlatformSleep(emu->platform, millis);
+}
+
+
+static void _MtosSysSleep(struct MtmcEmu* emu, i16 number) {
+    _MtmcSleep(emu, MtmcGetRegisterValue(emu, A0));
+}
+
+
+static i16 _MtmcVirtualTimer(struct MtmcEmu* emu, i16 millis) {
+    size_t now = _MtmcVirtualMillis(emu);
+    if (millis > 0) {
+        emu->timer = now + millis;
+    }
+    return emu->timer > now ? emu->timer - now : 0;
+}
 
-        case MtosSysCall_memcopy: {
-            i16 s = MtmcGetRegisterValue(emu, A0);
-            i16 t = MtmcGetRegisterValue(emu, A1);
-            i16 n = MtmcGetRegisterValue(emu, A2);
-            for (i16 i = 0; i < n; ++i) {
-                u8 x = MtmcFetchByteFromMemory(emu, s + i);
-                MtmcWriteByteToMemory(emu, t + i, x);
+
+static void _MtosSysTimer(struct MtmcEmu* emu, i16 number) {
+    i16 t = MtmcGetRegisterValue(emu, A0);
+    i16 x;
+    if (emu->virtual_clock != 0) {
+        x = _MtmcVirtualTimer(emu, t);
+        if (x > 0 && t <= 0 && _MtmcIsBusyWait(emu) != 0) {
+            /* jump to the deadline */
+            size_t speed = emu->speed != 0 ? emu->speed : Mtmc_DEFAULT_SPEED;
+            size_t deadline = (emu->timer * speed + 999) / 1000;
+            if (deadline > emu->clock + emu->clock_skew) {
+                emu->clock_skew = deadline - emu->clock;
             }
-            break;
+            x = _MtmcVirtualTimer(emu, 0);
         }
+    }
+    else {
+        x = PlatformSetTimer(emu->platform, t);
+        if (x > 0 && t <= 0 && _MtmcIsBusyWait(emu) != 0) {
+            _MtmcSleep(emu, x < _MtmcIdleMillis ? x : _MtmcIdleMillis);
+            x = PlatformSetTimer(emu->platform, 0);
+        }
+    }
+    MtmcSetRegisterValue(emu, RV, x);
+}
 
-        case MtosSysCall_drawimg: {
-            i16 i = MtmcGetRegisterValue(emu, A0);
-            i16 x = MtmcGetRegisterValue(emu, A1);
-            i16 y = MtmcGetRegisterValue(emu, A2);
-            i16 res = 1;
-            if (i >= 0 && i < (int)emu->graphics_count) {
-                PlatformDrawImage(emu->platform, &emu->graphics[i], x, y);
-                res = 0;
-            }
-            MtmcSetRegisterValue(emu, RV, res);
-            break;
+
+static void _MtosSysFrameReset(struct MtmcEmu* emu, i16 number) {
+    PlatformResetFrame(emu->platform);
+}
+
+
+static void _MtosSysFrameRect(struct MtmcEmu* emu, i16 number) {
+    PlatformFillRect(emu->platform,
+        MtmcGetRegisterValue(emu, A0),
+        MtmcGetRegisterValue(emu, A1),
+        MtmcGetRegisterValue(emu, A2),
+        MtmcGetRegisterValue(emu, A3)
+    );
+}
+
+
+static void _MtosSysFrameFlush(struct MtmcEmu* emu, i16 number) {
+    PlatformDrawFrame(emu->platform);
+}
+
+
+static void _MtosSysJoystick(struct MtmcEmu* emu, i16 number) {
+    if (_MtmcIsBusyWait(emu) != 0) {
+        _MtmcSleep(emu, _MtmcIdleMillis);
+    }
+    i16 state = PlatformGetJoystick(emu->platform);
+    MtmcSetRegisterValue(emu, IO, state);
+    MtmcSetRegisterValue(emu, RV, MtmcGetRegisterValue(emu, IO));
+}
+
+
+static void _MtosSysSetColor(struct MtmcEmu* emu, i16 number) {
+    i16 c = MtmcGetRegisterValue(emu, A0);
+    PlatformSetColor(emu->platform, c);
+}
+
+
+static void _MtosSysMemCopy(struct MtmcEmu* emu, i16 number) {
+    i16 s = MtmcGetRegisterValue(emu, A0);
+    i16 t = MtmcGetRegisterValue(emu, A1);
+    i16 n = MtmcGetRegisterValue(emu, A2);
+    MtmcCopyMemory(emu, s, t, n);
+}
+
+
+static void _MtosSysDrawImage(struct MtmcEmu* emu, i16 number) {
+    i16 i = MtmcGetRegisterValue(emu, A0);
+    i16 x = MtmcGetRegisterValue(emu, A1);
+    i16 y = MtmcGetRegisterValue(emu, A2);
+    i16 res = 1;
+    if (emu->graphics != NULL && i >= 0 && i < (int)emu->graphics->count) {
+        PlatformDrawImage(emu->platform, emu->graphics, i, x, y);
+        res = 0;
+    }
+    MtmcSetRegisterValue(emu, RV, res);
+}
+
+
+static void _MtosSysError(struct MtmcEmu* emu, i16 number) {
+    i16 addr = MtmcGetRegisterValue(emu, A0);
+    emu->status = MtmcEmuStatus_PERMANENT_ERROR;
+    fprintf(stderr, "program error: %s\n", (char*) &emu->memory[addr]);
+}
+
+
+const struct MtosSysCallTable MtosDefaultSysCalls = {
+    .entries = {
+        [MtosSysCall_exit] = { _MtosSysExit, MtosSysCallFlag_pure },
+        [MtosSysCall_rint] = { _MtosSysReadInt,
+            MtosSysCallFlag_blocking | MtosSysCallFlag_input },
+        [MtosSysCall_wint] = { _MtosSysWriteInt, MtosSysCallFlag_output },
+        [MtosSysCall_rstr] = { _MtosSysReadString,
+            MtosSysCallFlag_blocking | MtosSysCallFlag_input | MtosSysCallFlag_memory },
+        [MtosSysCall_wchr] = { _MtosSysWriteChar, MtosSysCallFlag_output },
+        [MtosSysCall_rchr] = { _MtosSysReadChar,
+            MtosSysCallFlag_blocking | MtosSysCallFlag_input },
+        [MtosSysCall_wstr] = { _MtosSysWriteString, MtosSysCallFlag_output },
+        [MtosSysCall_printf] = { _MtosSysPrintf, MtosSysCallFlag_output },
+        [MtosSysCall_atoi] = { _MtosSysAtoi, MtosSysCallFlag_pure },
+
+        [MtosSysCall_rfile] = { _MtosSysReadFile,
+            MtosSysCallFlag_input | MtosSysCallFlag_memory },
+        [MtosSysCall_wfile] = { _MtosSysWriteFile,
+            MtosSysCallFlag_input | MtosSysCallFlag_effect },
+        [MtosSysCall_cwd] = { _MtosSysCurrentDir,
+            MtosSysCallFlag_input | MtosSysCallFlag_memory },
+        [MtosSysCall_chdir] = { _MtosSysChangeDir,
+            MtosSysCallFlag_input | MtosSysCallFlag_effect },
+        [MtosSysCall_dirent] = { _MtosSysDirent,
+            MtosSysCallFlag_input | MtosSysCallFlag_memory },
+        [MtosSysCall_dfile] = { _MtosSysDeleteFile,
+            MtosSysCallFlag_input | MtosSysCallFlag_effect },
+
+        [MtosSysCall_rnd] = { _MtosSysRandom, MtosSysCallFlag_input },
+        [MtosSysCall_sleep] = { _MtosSysSleep, MtosSysCallFlag_blocking },
+        [MtosSysCall_timer] = { _MtosSysTimer,
+            MtosSysCallFlag_poll | MtosSysCallFlag_input },
+
+        [MtosSysCall_fbreset] = { _MtosSysFrameReset, MtosSysCallFlag_display },
+        [MtosSysCall_fbrect] = { _MtosSysFrameRect, MtosSysCallFlag_display },
+        [MtosSysCall_fbflush] = { _MtosSysFrameFlush, MtosSysCallFlag_display },
+        [MtosSysCall_joystick] = { _MtosSysJoystick,
+            MtosSysCallFlag_display | MtosSysCallFlag_poll | MtosSysCallFlag_input },
+        [MtosSysCall_scolor] = { _MtosSysSetColor, MtosSysCallFlag_display },
+
+        [MtosSysCall_memcopy] = { _MtosSysMemCopy, MtosSysCallFlag_pure },
+
+        [MtosSysCall_drawimg] = { _MtosSysDrawImage, MtosSysCallFlag_display },
+
+        [MtosSysCall_error] = { _MtosSysError, MtosSysCallFlag_pure },
+    },
+};
+
+
+void MtosSysCallTableInit(struct MtosSysCallTable* table) {
+    *table = MtosDefaultSysCalls;
+}
+
+
+void MtosSysCallRegister(struct MtosSysCallTable* table, u8 number,
+    MtosSysCallHandler handler, u8 flags) {
+    table->entries[number] = (struct MtosSysCallEntry) {
+        .handler = handler,
+        .flags = flags,
+    };
+}
+
+
+/* The session log starts with a magic, followed by one record per
+   input syscall: varint instruction delta, number, RV and IO words,
+   and for calls that write memory, varint count of changed runs,
+   each as varint address, varint size and the bytes. */
+static const char _MtmcSessionMagic[8] = "MTMCREC1";
+
+
+static void _MtmcPutVarint(FILE* file, u64 x) {
+    while (x >= 0x80) {
+        fputc((x & 0x7F) | 0x80, file);
+        x >>= 7;
+    }
+    fputc(x, file);
+}
+
+
+static int _MtmcGetVarint(FILE* file, u64* x) {
+    *x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF) { return 1; }
+        *x |= (u64)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) { return 0; }
+    }
+    return 1;
+}
+
+
+static void _MtmcPutWord(FILE* file, i16 x) {
+    fputc((u16)x & 0xFF, file);
+    fputc((u16)x >> 8, file);
+}
+
+
+static int _MtmcGetWord(FILE* file, i16* x) {
+    int lo = fgetc(file);
+    int hi = fgetc(file);
+    if (lo == EOF || hi == EOF) { return 1; }
+    *x = (i16)(lo | (hi << 8));
+    return 0;
+}
+
+
+int MtmcSetRecord(struct MtmcEmu* emu, FILE* file) {
+    if (fwrite(_MtmcSessionMagic, sizeof(_MtmcSessionMagic), 1, file) != 1) {
+        perror("fwrite");
+        return 1;
+    }
+    emu->record = file;
+    emu->session_clock = 0;
+    return 0;
+}
+
+
+/* Replay does not wait on the host, so time is virtual as well. */
+int MtmcSetReplay(struct MtmcEmu* emu, FILE* file) {
+    char magic[sizeof(_MtmcSessionMagic)];
+    if (fread(magic, sizeof(magic), 1, file) != 1 ||
+        memcmp(magic, _MtmcSessionMagic, sizeof(magic)) != 0) {
+        fputs("replay: not a session log\n", stderr);
+        return 1;
+    }
+    emu->replay = file;
+    emu->session_clock = 0;
+    emu->virtual_clock = 1;
+    return 0;
+}
+
+
+static void _MtmcRecordSysCall(struct MtmcEmu* emu, i16 number,
+    const struct MtosSysCallEntry* entry) {
+    u8 before[Mtmc_MEMORY_SIZE];
+    if ((entry->flags & MtosSysCallFlag_memory) != 0) {
+        memcpy(before, emu->memory, sizeof(before));
+    }
+    entry->handler(emu, number);
+
+    FILE* file = emu->record;
+    _MtmcPutVarint(file, emu->clock - emu->session_clock);
+    emu->session_clock = emu->clock;
+    fputc((u8)number, file);
+    _MtmcPutWord(file, MtmcGetRegisterValue(emu, RV));
+    _MtmcPutWord(file, MtmcGetRegisterValue(emu, IO));
+    if ((entry->flags & MtosSysCallFlag_memory) == 0) { return; }
+
+    size_t runs = 0;
+    for (size_t i = 0; i < sizeof(before); ++i) {
+        if (before[i] == emu->memory[i]) { continue; }
+        runs += 1;
+        while (i < sizeof(before) && before[i] != emu->memory[i]) { ++i; }
+    }
+    _MtmcPutVarint(file, runs);
+    for (size_t i = 0; i < sizeof(before); ++i) {
+        if (before[i] == emu->memory[i]) { continue; }
+        size_t start = i;
+        while (i < sizeof(before) && before[i] != emu->memory[i]) { ++i; }
+        _MtmcPutVarint(file, start);
+        _MtmcPutVarint(file, i - start);
+        fwrite(&emu->memory[start], 1, i - start, file);
+    }
+}
+
+
+static void _MtmcReplaySysCall(struct MtmcEmu* emu, i16 number, u8 flags) {
+    FILE* file = emu->replay;
+    u64 delta;
+    int c;
+    i16 rv, io;
+    if (_MtmcGetVarint(file, &delta) != 0 ||
+        (c = fgetc(file)) == EOF ||
+        _MtmcGetWord(file, &rv) != 0 ||
+        _MtmcGetWord(file, &io) != 0) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "replay: log ended at instruction %zu", emu->clock);
+        return;
+    }
+    emu->session_clock += delta;
+    if (c != (u8)number || emu->session_clock != emu->clock) {
+        MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+            "replay: diverged at instruction %zu", emu->clock);
+        return;
+    }
+    MtmcSetRegisterValue(emu, RV, rv);
+    MtmcSetRegisterValue(emu, IO, io);
+    if ((flags & MtosSysCallFlag_memory) == 0) { return; }
+
+    u64 runs;
+    if (_MtmcGetVarint(file, &runs) != 0) { runs = 0; }
+    for (u64 i = 0; i < runs; ++i) {
+        u64 start, size;
+        if (_MtmcGetVarint(file, &start) != 0 ||
+            _MtmcGetVarint(file, &size) != 0 ||
+            start + size > sizeof(emu->memory) ||
+            fread(&emu->memory[start], 1, size, file) != size) {
+            MtmcSetErrorStatus(emu, MtmcEmuStatus_PERMANENT_ERROR,
+                "replay: bad memory record at instruction %zu", emu->clock);
+            return;
         }
+    }
+}
 
-        case MtosSysCall_drawimgsz:
-        case MtosSysCall_drawimgclip:
-            FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
-            break;
 
-        case MtosSysCall_error: {
-            i16 addr = MtmcGetRegisterValue(emu, A0);
-            emu->status = MtmcEmuStatus_PERMANENT_ERROR;
-            fprintf(stderr, "program error: %s\n", (char*) &emu->memory[addr]);
-            break;
+void MtosHandleSysCall(struct MtmcEmu* emu, i16 number) {
+    const struct MtosSysCallTable* table = emu->syscalls;
+    if (table == NULL) {
+        table = &MtosDefaultSysCalls;
+    }
+    const struct MtosSysCallEntry* entry = &table->entries[(u8)number];
+    emu->usage.syscalls += 1;
+    if (entry->handler == NULL) {
+        FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
+    }
+    if ((entry->flags & MtosSysCallFlag_input) == 0) {
+        entry->handler(emu, number);
+    }
+    else if (emu->replay != NULL) {
+        if ((entry->flags & MtosSysCallFlag_effect) != 0) {
+            entry->handler(emu, number);
         }
+        _MtmcReplaySysCall(emu, number, entry->flags);
+    }
+    else if (emu->record != NULL) {
+        _MtmcRecordSysCall(emu, number, entry);
+    }
+    else {
+        entry->handler(emu, number);
+    }
 
-        default:
-            FatalErrorFmt("unhandled SYS CALL %02x", (u16)number);
+    if ((entry->flags & MtosSysCallFlag_poll) == 0) {
+        emu->poll_pc = -1;
     }
 
-    if (PlatformIsClosed(emu->platform) != 0) {
-        emu->status = MtmcEmuStatus_FINISHED;
+    if ((entry->flags & MtosSysCallFlag_output) != 0) {
+        /* PC is past the single word sys instruction */
+        _MtmcCheckOutput(emu, 0, MtmcGetRegisterValue(emu, PC) - 2);
+    }
+
+    /* only calls that wait or reach the window can see it closing */
+    if ((entry->flags & (MtosSysCallFlag_blocking | MtosSysCallFlag_display)) != 0) {
+        if (PlatformIsClosed(emu->platform) != 0) {
+            emu->status = MtmcEmuStatus_FINISHED;
+        }
     }
 }
 
 
 #ifdef PNG_LIBPNG_VER
 
+#include <zlib.h>
+
 
 static const png_color _MtmcPngPalette[5] = {
     { _MtmcPalette[0][0], _MtmcPalette[0][1], _MtmcPalette[0][2] },
@@ -1466,8 +2262,216 @@ int MtmcGraphicLoad(struct MtmcGraphic* graphic, FILE* file) {
 }
 
 
+enum {
+    _MtmcPngIndex_invalid = 0xFF,
+    _MtmcPngIndex_transparent = 4,
+};
+
+
+struct _MtmcPngDecoder {
+    struct MtmcGraphic* graphic;
+    z_stream zs;
+    /* palette index to 2-bit color, or transparent flag */
+    u8 colors[256];
+    /* bits per pixel, rows are packed with the leftmost pixel high */
+    int depth;
+    size_t stride;
+    int row;
+    u8* prev;
+    u8* cur;
+    u8 rows[2][1 + MtmcGraphics_width_max];
+};
+
+
+static u32 _MtmcPngReadU32(const u8* p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+
+static void _MtmcPngSetPalette(struct _MtmcPngDecoder* dec,
+    const u8* plte, size_t count, const u8* trns, size_t trnscount) {
+    memset(dec->colors, _MtmcPngIndex_invalid, sizeof(dec->colors));
+    for (size_t i = 0; i < count; ++i) {
+        u8 c = 0;
+        int d = 0x7fffffff;
+        for (int pi = 0; pi < 4; ++pi) {
+            int r = (plte[i * 3] - _MtmcPngPalette[pi].red);
+            int g = (plte[i * 3 + 1] - _MtmcPngPalette[pi].green);
+            int b = (plte[i * 3 + 2] - _MtmcPngPalette[pi].blue);
+            int dist = r * r + g * g + b * b;
+            if (dist < d) {
+                d = dist;
+                c = pi;
+            }
+        }
+        int alp = i < trnscount ? trns[i] : 255;
+        dec->colors[i] = c | ((alp < 127) ? _MtmcPngIndex_transparent : 0);
+    }
+}
+
+
+static int _MtmcPngDecodeRow(struct _MtmcPngDecoder* dec) {
+    u8* cur = dec->cur + 1;
+    const u8* prev = dec->prev + 1;
+    size_t n = dec->stride - 1;
+    switch (dec->cur[0]) {
+        case 0:
+            break;
+        case 1:
+            for (size_t i = 1; i < n; ++i) { cur[i] += cur[i - 1]; }
+            break;
+        case 2:
+            for (size_t i = 0; i < n; ++i) { cur[i] += prev[i]; }
+            break;
+        case 3:
+            cur[0] += prev[0] / 2;
+            for (size_t i = 1; i < n; ++i) { cur[i] += (cur[i - 1] + prev[i]) / 2; }
+            break;
+        case 4:
+            cur[0] += prev[0];
+            for (size_t i = 1; i < n; ++i) {
+                int a = cur[i - 1], b = prev[i], c = prev[i - 1];
+                int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+                cur[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+            }
+            break;
+        default:
+            return 1;
+    }
+
+    struct MtmcGraphic* graphic = dec->graphic;
+    u8* mask = &graphic->mask[(graphic->width + 7) / 8 * dec->row];
+    u8* data = &graphic->data[(graphic->width + 3) / 4 * dec->row];
+    int depth = dec->depth;
+    u8 bits = (1 << depth) - 1;
+    for (size_t col = 0; col < (size_t)graphic->width; ++col) {
+        size_t bit = col * depth;
+        u8 c = dec->colors[(cur[bit / 8] >> (8 - depth - bit % 8)) & bits];
+        if (c == _MtmcPngIndex_invalid) { return 1; }
+        data[col / 4] |= (c & 3) << (col % 4 * 2);
+        mask[col / 8] |= ((c & _MtmcPngIndex_transparent) != 0) << (col % 8);
+    }
+
+    dec->row += 1;
+    u8* t = dec->prev;
+    dec->prev = dec->cur;
+    dec->cur = t;
+    return 0;
+}
+
+
+static int _MtmcPngInflate(struct _MtmcPngDecoder* dec, const u8* data, size_t size) {
+    dec->zs.next_in = (Bytef*)data;
+    dec->zs.avail_in = size;
+    while (dec->zs.avail_in > 0) {
+        int res = inflate(&dec->zs, Z_NO_FLUSH);
+        if (dec->zs.avail_out == 0 && dec->row < dec->graphic->height) {
+            if (_MtmcPngDecodeRow(dec) != 0) { return 1; }
+            if (dec->row < dec->graphic->height) {
+                dec->zs.next_out = dec->cur;
+                dec->zs.avail_out = dec->stride;
+            }
+        }
+        if (res == Z_STREAM_END) {
+            return (dec->row == dec->graphic->height) ? 0 : 1;
+        }
+        if (res != Z_OK) { return 1; }
+    }
+    return 0;
+}
+
+
+/* Fast path for indexed images, as written by MtmcGraphicWrite, and of
+   any lower bit depth. Returns nonzero for anything else, leaving it
+   to libpng. */
+static int _MtmcGraphicLoadIndexedPng(struct MtmcGraphic* graphic,
+    const u8* data, size_t datasize) {
+    static const u8 signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    if (datasize < 8 + 25 || memcmp(data, signature, 8) != 0) { return 1; }
+
+    struct _MtmcPngDecoder dec = {};
+    const u8* plte = NULL;
+    const u8* trns = NULL;
+    size_t plte_count = 0;
+    size_t trns_count = 0;
+    int header = 0;
+    int inflating = 0;
+    int res = 1;
+
+    for (size_t pos = 8; pos + 12 <= datasize; ) {
+        u32 length = _MtmcPngReadU32(&data[pos]);
+        const u8* type = &data[pos + 4];
+        const u8* chunk = &data[pos + 8];
+        if (length > datasize - pos - 12) { break; }
+        u32 crc = crc32(0, type, length + 4);
+        if (crc != _MtmcPngReadU32(&chunk[length])) { break; }
+        pos += length + 12;
+
+        if (memcmp(type, "IHDR", 4) == 0) {
+            if (length != 13) { break; }
+            u32 width = _MtmcPngReadU32(&chunk[0]);
+            u32 height = _MtmcPngReadU32(&chunk[4]);
+            if (width == 0 || width > MtmcGraphics_width_max) { break; }
+            if (height == 0 || height > MtmcGraphics_height_max) { break; }
+            int depth = chunk[8];
+            if ((depth != 1 && depth != 2 && depth != 4 && depth != 8) ||
+                chunk[9] != PNG_COLOR_TYPE_PALETTE ||
+                chunk[10] != 0 || chunk[11] != 0 || chunk[12] != 0) { break; }
+            *graphic = (struct MtmcGraphic) {};
+            graphic->width = width;
+            graphic->height = height;
+            dec.depth = depth;
+            header = 1;
+        }
+        else if (header == 0) {
+            break;
+        }
+        else if (memcmp(type, "PLTE", 4) == 0) {
+            if (length % 3 != 0 || length > 256 * 3) { break; }
+            plte = chunk;
+            plte_count = length / 3;
+        }
+        else if (memcmp(type, "tRNS", 4) == 0) {
+            trns = chunk;
+            trns_count = length;
+        }
+        else if (memcmp(type, "IDAT", 4) == 0) {
+            if (inflating == 0) {
+                if (plte == NULL || trns_count > plte_count) { break; }
+                _MtmcPngSetPalette(&dec, plte, plte_count, trns, trns_count);
+                if (inflateInit(&dec.zs) != Z_OK) { break; }
+                inflating = 1;
+                dec.graphic = graphic;
+                dec.stride = (graphic->width * dec.depth + 7) / 8 + 1;
+                dec.prev = dec.rows[0];
+                dec.cur = dec.rows[1];
+                dec.zs.next_out = dec.cur;
+                dec.zs.avail_out = dec.stride;
+            }
+            if (_MtmcPngInflate(&dec, chunk, length) != 0) { break; }
+        }
+        else if (memcmp(type, "IEND", 4) == 0) {
+            res = (inflating != 0 && dec.row == graphic->height) ? 0 : 1;
+            break;
+        }
+        else if ((type[0] & 0x20) == 0) {
+            /* unknown critical chunk */
+            break;
+        }
+    }
+
+    if (inflating != 0) {
+        inflateEnd(&dec.zs);
+    }
+    return res;
+}
+
+
 static int _MtmcGraphicLoadPng(struct MtmcGraphic* graphic,
     const u8* data, size_t datasize) {
+    if (_MtmcGraphicLoadIndexedPng(graphic, data, datasize) == 0) {
+        return 0;
+    }
     FILE* fp = fmemopen((void*)data, datasize, "rb");
     if (fp == NULL) { perror("fmemopen"); return 1; }
     int res = MtmcGraphicLoad(graphic, fp);
@@ -1537,63 +2541,81 @@ int MtmcGraphicWrite(struct MtmcGraphic* graphic, FILE* file) {
 
 static JsonError _json_reader_read_i8_array(JSON* context, u8* buf, size_t* bufsize) {
     size_t limit = *bufsize;
-    *bufsize = 0;
-    JSON ar;
-    JsonValueType type;
-    JsonError err = json_reader_open_array(context, &ar);
-    _assert_json_ok(err, "json_reader_open_array");
-    size_t count = 0;
-    for (;;) {
-        err = json_reader_read_array(&ar, &type);
-        if (err == JsonError_not_found) { break; }
-        _assert_json_ok(err, "json_reader_read_array");
-
-        if (count >= limit) {
+    JsonError err = json_reader_read_int_array(context, JsonIntType_i8,
+        buf, limit, bufsize);
+    switch (err) {
+        case JsonError_ok:
+            break;
+        case JsonError_bufsize:
             fprintf(stderr, "error: array is over %zu bytes\n", limit);
-            return JsonError_bufsize;
-        }
-
-        if (type != JsonValueType_number) {
-            return JsonError_type_mismatch;
-        }
-
-        int x;
-        err = json_reader_read_numberi(&ar, &x);
-        _assert_json_ok(err, "json_reader_read_numberi");
-        if (x < -128 || x > 127) {
-            fprintf(stderr, "error: invalid byte value %d\n", x);
-            return JsonError_invalid;
-        }
-
-        buf[count++] = x;
+            return err;
+        case JsonError_invalid:
+            fprintf(stderr, "error: invalid byte value at %zu\n", *bufsize);
+            return err;
+        default:
+            _assert_json_ok(err, "json_reader_read_int_array");
     }
-    *bufsize = count;
     return JsonError_ok;
 }
 
 
-static JsonError _json_reader_read_graphics(JSON* context, struct MtmcGraphic* graphic) {
+/* Decoding buffers for one image, kept off the stack */
+struct _MtmcGraphicScratch {
     u8 data[MtmcGraphics_bytes_max];
-    size_t datasize = sizeof(data);
-    JsonError err = _json_reader_read_i8_array(context, data, &datasize);
+    struct MtmcGraphic graphic;
+};
+
+
+static JsonError _json_reader_read_graphics(JSON* context,
+    struct _MtmcGraphicScratch* scratch, struct MtmcSpriteAtlas* atlas) {
+    size_t datasize = sizeof(scratch->data);
+    JsonError err = _json_reader_read_i8_array(context, scratch->data, &datasize);
     _assert_json_ok(err, "json_reader_read_i8_array");
-    int res = _MtmcGraphicLoadPng(graphic, data, datasize);
+    int res = _MtmcGraphicLoadPng(&scratch->graphic, scratch->data, datasize);
+    if (res != 0) { return JsonError_invalid; }
+    res = MtmcSpriteAtlasAppend(atlas, &scratch->graphic);
     if (res != 0) { return JsonError_invalid; }
     return JsonError_ok;
 }
 
 
-int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
-    JSON json, content, ar;
-    int err = json_reader_init(&json, file);
-    _assert_json_ok(err, "json_reader_init");
+/* Reads a byte array to the end of the arena, growing it by the
+   memory size first. */
+static int _MtmcExecutableReadArray(JSON* context, struct MtmcExecutable* exe,
+    size_t* used, const char* name, size_t* offset, size_t* size) {
+    u8* arena = realloc(exe->arena, *used + Mtmc_MEMORY_SIZE);
+    if (arena == NULL) {
+        perror("realloc");
+        return 1;
+    }
+    exe->arena = arena;
+    *size = 0;
+    int err = json_reader_read_int_array(context, JsonIntType_i8,
+        &arena[*used], Mtmc_MEMORY_SIZE, size);
+    if (err == JsonError_bufsize) {
+        fprintf(stderr, "%s: out of memory at %zd\n", name, *size);
+        return 1;
+    }
+    if (err != JsonError_ok) {
+        fprintf(stderr, "%s: json_reader_read_int_array: error %d\n", name, err);
+        return 1;
+    }
+    *offset = *used;
+    *used += *size;
+    return 0;
+}
+
 
-    err = json_reader_open_object(&json, &content);
+static int _MtmcExecutableLoadSections(JSON* json, struct MtmcExecutable* exe,
+    struct _MtmcGraphicScratch** scratch) {
+    JSON content, ar;
+    int err = json_reader_open_object(json, &content);
     _assert_json_ok(err, "json_reader_open_object");
 
     JsonValueType type;
     char key[20], svalue[100];
     size_t keysize, valsize;
+    size_t used = 0, codeoffset = 0, dataoffset = 0;
 
     for (;;) {
         keysize = sizeof(key);
@@ -1615,58 +2637,14 @@ int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
             }
         }
         else if (strcmp(key, "code") == 0) {
-            size_t codesize = 0;
-            err = json_reader_open_array(&content, &ar);
-            _assert_json_ok(err, "json_reader_open_array");
-            for (;;) {
-                err = json_reader_read_array(&ar, &type);
-                if (err == JsonError_not_found) { break; }
-                _assert_json_ok(err, "json_reader_read_array");
-
-                if (codesize >= sizeof(exe->code)/sizeof(exe->code[0])) {
-                    fprintf(stderr, "code: out of memory at %zd\n", codesize);
-                    return 1;
-                }
-
-                if (type == JsonValueType_number) {
-                    int x;
-                    err = json_reader_read_numberi(&ar, &x);
-                    _assert_json_ok(err, "json_reader_read_numberi");
-                    exe->code[codesize++] = x;
-                }
-                else {
-                    fprintf(stderr, "code: unexpected value type %d\n", type);
-                    return 1;
-                }
-            }
-            exe->codesize = codesize;
+            int res = _MtmcExecutableReadArray(&content, exe, &used, key,
+                &codeoffset, &exe->codesize);
+            if (res != 0) { return res; }
         }
         else if (strcmp(key, "data") == 0) {
-            size_t datasize = 0;
-            err = json_reader_open_array(&content, &ar);
-            _assert_json_ok(err, "json_reader_open_array");
-            for (;;) {
-                err = json_reader_read_array(&ar, &type);
-                if (err == JsonError_not_found) { break; }
-                _assert_json_ok(err, "json_reader_read_array");
-
-                if (datasize >= sizeof(exe->data)/sizeof(exe->data[0])) {
-                    fprintf(stderr, "data: out of memory at %zd\n", datasize);
-                    return 1;
-                }
-
-                if (type == JsonValueType_number) {
-                    int x;
-                    err = json_reader_read_numberi(&ar, &x);
-                    _assert_json_ok(err, "json_reader_read_numberi");
-                    exe->data[datasize++] = x;
-                }
-                else {
-                    fprintf(stderr, "data: unexpected value type %d\n", type);
-                    return 1;
-                }
-            }
-            exe->datasize = datasize;
+            int res = _MtmcExecutableReadArray(&content, exe, &used, key,
+                &dataoffset, &exe->datasize);
+            if (res != 0) { return res; }
         }
         else if (strcmp(key, "graphics") == 0) {
             err = json_reader_open_array(&content, &ar);
@@ -1676,7 +2654,7 @@ int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
                 if (err == JsonError_not_found) { break; }
                 _assert_json_ok(err, "json_reader_read_array");
 
-                if (exe->graphics_count >= MtmcGraphics_max) {
+                if (exe->graphics.count >= MtmcGraphics_max) {
                     fprintf(stderr, "error: max graphics limit %d\n", MtmcGraphics_max);
                     err = json_reader_consume_value(&ar);
                     _assert_json_ok(err, "json_reader_consume_value");
@@ -1687,13 +2665,19 @@ int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
                     fprintf(stderr, "invalid graphics json type %d\n", type);
                     err = json_reader_consume_value(&ar);
                     _assert_json_ok(err, "json_reader_consume_value");
-                    exe->graphics_count += 1;
+                    MtmcSpriteAtlasAppend(&exe->graphics, NULL);
                     continue;
                 }
 
-                err = _json_reader_read_graphics(&ar, &exe->graphics[exe->graphics_count]);
+                if (*scratch == NULL) {
+                    *scratch = malloc(sizeof(struct _MtmcGraphicScratch));
+                    if (*scratch == NULL) {
+                        perror("malloc");
+                        return 1;
+                    }
+                }
+                err = _json_reader_read_graphics(&ar, *scratch, &exe->graphics);
                 _assert_json_ok(err, "json_reader_read_graphics");
-                exe->graphics_count += 1;
             }
         }
         else {
@@ -1702,29 +2686,88 @@ int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
         }
     }
 
+    if (used > 0) {
+        u8* arena = realloc(exe->arena, used);
+        if (arena != NULL) { exe->arena = arena; }
+        exe->code = &exe->arena[codeoffset];
+        exe->data = &exe->arena[dataoffset];
+    }
     return 0;
 }
 
 
+/* Code and data are read into one arena, which is then shrunk to fit,
+   and images are decoded straight into the sprite atlas. */
+static int _MtmcExecutableLoadJson(JSON* json, struct MtmcExecutable* exe) {
+    struct _MtmcGraphicScratch* scratch = NULL;
+    int res = _MtmcExecutableLoadSections(json, exe, &scratch);
+    free(scratch);
+    if (res != 0) { return res; }
+
+    struct MtmcSpriteAtlas* atlas = &exe->graphics;
+    if (atlas->size > 0 && atlas->size < atlas->capacity) {
+        u8* pixels = realloc(atlas->pixels, atlas->size);
+        if (pixels != NULL) {
+            atlas->pixels = pixels;
+            atlas->capacity = atlas->size;
+        }
+    }
+    return 0;
+}
+
+
+int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
+    JSON json;
+    JsonStream stream;
+    int err = json_reader_init_buffered(&json, &stream, file, 0, NULL);
+    _assert_json_ok(err, "json_reader_init_buffered");
+    int res = _MtmcExecutableLoadJson(&json, exe);
+    json_reader_close(&json);
+    return res;
+}
+
+
 #endif /* PAIV_JSON_ */
 
 
 int MtmcPlatformRun(PlatformState platform, FILE* file, const char* arg,
-    int speed, int trace_level) {
+    const struct MtmcRunOptions* options) {
     struct MtmcExecutable exe = {};
     int res = MtmcExecutableLoad(file, &exe);
-    if (res != 0) { return res; }
+    if (res != 0) {
+        MtmcExecutableDeinit(&exe);
+        return res;
+    }
     struct MtmcEmu emu = {
         .platform = platform,
-        .speed = speed,
-        .trace_level = trace_level,
+        .speed = options->speed,
+        .trace_level = options->trace_level,
+        .virtual_clock = options->virtual_clock,
+        .budget = options->budget,
         };
     MtmcLoad(&emu, &exe);
+    MtmcRandomSeed(&emu.random, options->seed);
+    if (options->record != NULL) {
+        res = MtmcSetRecord(&emu, options->record);
+    }
+    if (res == 0 && options->replay != NULL) {
+        res = MtmcSetReplay(&emu, options->replay);
+    }
+    if (res != 0) {
+        MtmcExecutableDeinit(&exe);
+        return res;
+    }
     if (arg != NULL) {
         MtmcSetArg(&emu, arg);
     }
     MtmcRun(&emu);
-    return 0;
+    MtmcExecutableDeinit(&exe);
+    if (options->record != NULL && fflush(options->record) != 0) {
+        perror("record");
+        return 1;
+    }
+    if (emu.status == MtmcEmuStatus_OUTPUT_MISMATCH) { return 1; }
+    return (_MtmcStatusLimitName(emu.status) != NULL) ? 1 : 0;
 }
 
 
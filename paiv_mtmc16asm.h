@@ -9,7 +9,6 @@ extern "C" {
 
 enum {
     MtmcAsm_identifier_max = 64,
-    MtmcAsm_symbols_max = 1024,
 };
 
 
@@ -29,6 +28,9 @@ int MtmcDisassemble(FILE* input, FILE* output, const char* input_filename,
 #ifdef PAIV_MTMCASM_IMPLEMENTATION
 
 
+#include <stddef.h>
+
+
 struct _GraphicsImport {
     char filename[PATH_MAX];
 };
@@ -47,6 +49,7 @@ struct MtmcExeObject {
 
 int MtmcAssemblerCompileSource(FILE* source, struct MtmcExeObject* exe,
     const char* source_path);
+void MtmcAssemblerReleaseMemory(void);
 int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output);
 int MtmcDecompileExecutable(struct MtmcExecutable* exe, FILE* output,
     int code_bytes);
@@ -98,11 +101,26 @@ enum _AssemblerStatus {
 };
 
 
+/* Bump allocator for the assembler tables. The blocks outlive a
+   compilation and are reused by the next one on the same thread. */
+struct _AsmArenaBlock {
+    struct _AsmArenaBlock* next;
+    size_t size;
+    size_t capacity;
+    max_align_t data[];
+};
+
+
+struct _AsmArena {
+    struct _AsmArenaBlock* head;
+    struct _AsmArenaBlock* current;
+};
+
+
 struct _SymTable {
-    size_t datasize;
-    char data[MtmcAsm_symbols_max * (MtmcAsm_identifier_max + 1)];
     size_t symcount;
-    char* symbols[MtmcAsm_symbols_max];
+    size_t symcapacity;
+    const char** symbols;
 };
 
 
@@ -129,14 +147,26 @@ struct AssemblerState {
     enum _TokenizerStatus tokstate;
     enum _AssemblerStatus status;
     int argcount;
+    struct _AsmArena* arena;
     struct _SymTable symtable;
     size_t labelcount;
-    struct _AsmLabel labels[Mtmc_MEMORY_SIZE];
+    size_t labelcapacity;
+    struct _AsmLabel* labels;
     size_t forwardsize;
-    struct _ForwardRef forwardrefs[Mtmc_MEMORY_SIZE+1];
+    size_t forwardcapacity;
+    struct _ForwardRef* forwardrefs;
+};
+
+
+enum {
+    _AsmArenaBlockSize = 16 * 1024,
+    _AsmArenaTableSize = 64,
 };
 
 
+static _Thread_local struct _AsmArena _MtmcAsmArena;
+
+
 static const char* _AsmTokenType(enum AsmTokenType type) {
     static const char* const names[] = {
         "invalid",
@@ -731,30 +761,91 @@ static int _MtmcAssemblerParseSysCall(struct AsmToken* token, i16* addr) {
 }
 
 
-static const char* _SymTableAppendSymbol(struct _SymTable* table, const char* name) {
-    int n = strlen(name) + 1;
-    if (table->datasize + n > sizeof(table->data)) {
-        return NULL;
+static void* _AsmArenaAlloc(struct _AsmArena* arena, size_t size) {
+    size_t align = sizeof(max_align_t);
+    size = (size + align - 1) / align * align;
+    struct _AsmArenaBlock* block = arena->current;
+    struct _AsmArenaBlock** link = (block != NULL) ? &block->next : &arena->head;
+    while (block == NULL || block->size + size > block->capacity) {
+        if (*link == NULL) {
+            size_t capacity = size > _AsmArenaBlockSize ? size : _AsmArenaBlockSize;
+            struct _AsmArenaBlock* fresh = malloc(sizeof(*fresh) + capacity);
+            if (fresh == NULL) {
+                perror("malloc");
+                return NULL;
+            }
+            *fresh = (struct _AsmArenaBlock) { .capacity = capacity };
+            *link = fresh;
+        }
+        block = *link;
+        link = &block->next;
+    }
+    arena->current = block;
+    void* p = (u8*)block->data + block->size;
+    block->size += size;
+    return p;
+}
+
+
+static void _AsmArenaReset(struct _AsmArena* arena) {
+    for (struct _AsmArenaBlock* block = arena->head; block != NULL; block = block->next) {
+        block->size = 0;
+    }
+    arena->current = arena->head;
+}
+
+
+static void _AsmArenaDeinit(struct _AsmArena* arena) {
+    struct _AsmArenaBlock* block = arena->head;
+    while (block != NULL) {
+        struct _AsmArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    *arena = (struct _AsmArena) {};
+}
+
+
+/* Doubles a table, leaving the old copy in the arena until reset. */
+static void* _AsmArenaGrow(struct _AsmArena* arena, void* items,
+    size_t* capacity, size_t itemsize) {
+    size_t n = (*capacity != 0) ? *capacity * 2 : _AsmArenaTableSize;
+    void* p = _AsmArenaAlloc(arena, n * itemsize);
+    if (p == NULL) { return NULL; }
+    if (*capacity != 0) {
+        memcpy(p, items, *capacity * itemsize);
     }
-    if (table->symcount + 1 > sizeof(table->symbols)/sizeof(table->symbols[0])) {
-        return NULL;
+    *capacity = n;
+    return p;
+}
+
+
+static const char* _SymTableAppendSymbol(struct _AsmArena* arena,
+    struct _SymTable* table, const char* name) {
+    if (table->symcount == table->symcapacity) {
+        const char** symbols = _AsmArenaGrow(arena, table->symbols,
+            &table->symcapacity, sizeof(const char*));
+        if (symbols == NULL) { return NULL; }
+        table->symbols = symbols;
     }
-    char* p = &table->data[table->datasize];
-    strcpy(p, name);
-    table->datasize += n;
+    size_t n = strlen(name) + 1;
+    char* p = _AsmArenaAlloc(arena, n);
+    if (p == NULL) { return NULL; }
+    memcpy(p, name, n);
     table->symbols[table->symcount++] = p;
     return p;
 }
 
 
-static const char* _SymTableResolveSymbol(struct _SymTable* table, const char* name) {
-    char* const * p = &table->symbols[0];
+static const char* _SymTableResolveSymbol(struct _AsmArena* arena,
+    struct _SymTable* table, const char* name) {
+    const char* const * p = &table->symbols[0];
     for (size_t i = 0; i < table->symcount; ++i, ++p) {
         if (strcmp(*p, name) == 0) {
             return *p;
         }
     }
-    return _SymTableAppendSymbol(table, name);
+    return _SymTableAppendSymbol(arena, table, name);
 }
 
 
@@ -834,12 +925,23 @@ static int _MtmcAssemblerEmitDataString(struct AssemblerState* state,
 }
 
 
-static int _MtmcAssemblerEmitDataLabel(struct AssemblerState* state,
-    struct AsmToken* token) {
-    const char* symbol = _SymTableResolveSymbol(&state->symtable, token->text);
-    u16 addr = state->exe->datasize;
+static int _MtmcAssemblerAddLabel(struct AssemblerState* state,
+    struct AsmToken* token, u8 isdata, u16 addr) {
+    const char* symbol = _SymTableResolveSymbol(state->arena,
+        &state->symtable, token->text);
+    if (symbol == NULL) {
+        return _AssemblerError(token, "out of memory");
+    }
+    if (state->labelcount == state->labelcapacity) {
+        struct _AsmLabel* labels = _AsmArenaGrow(state->arena, state->labels,
+            &state->labelcapacity, sizeof(struct _AsmLabel));
+        if (labels == NULL) {
+            return _AssemblerError(token, "out of memory");
+        }
+        state->labels = labels;
+    }
     state->labels[state->labelcount++] = (struct _AsmLabel) {
-        .isdata = 1,
+        .isdata = isdata,
         .addr = addr,
         .symbol = symbol,
     };
@@ -847,16 +949,15 @@ static int _MtmcAssemblerEmitDataLabel(struct AssemblerState* state,
 }
 
 
+static int _MtmcAssemblerEmitDataLabel(struct AssemblerState* state,
+    struct AsmToken* token) {
+    return _MtmcAssemblerAddLabel(state, token, 1, state->exe->datasize);
+}
+
+
 static int _MtmcAssemblerEmitCodeLabel(struct AssemblerState* state,
     struct AsmToken* token) {
-    const char* symbol = _SymTableResolveSymbol(&state->symtable, token->text);
-    u16 addr = state->exe->codesize;
-    state->labels[state->labelcount++] = (struct _AsmLabel) {
-        .isdata = 0,
-        .addr = addr,
-        .symbol = symbol,
-    };
-    return 0;
+    return _MtmcAssemblerAddLabel(state, token, 0, state->exe->codesize);
 }
 
 
@@ -885,16 +986,29 @@ static int _MtmcAssemblerEmitGraphicsImport(struct AssemblerState* state,
 }
 
 
-static void _MtmcAssemblerAddForwardReference(struct AssemblerState* state,
+static int _MtmcAssemblerAddForwardReference(struct AssemblerState* state,
     struct AsmToken* token) {
     u16 pc = state->exe->codesize;
-    const char* symbol = _SymTableResolveSymbol(&state->symtable, token->text);
+    const char* symbol = _SymTableResolveSymbol(state->arena,
+        &state->symtable, token->text);
+    if (symbol == NULL) {
+        return _AssemblerError(token, "out of memory");
+    }
+    if (state->forwardsize == state->forwardcapacity) {
+        struct _ForwardRef* refs = _AsmArenaGrow(state->arena, state->forwardrefs,
+            &state->forwardcapacity, sizeof(struct _ForwardRef));
+        if (refs == NULL) {
+            return _AssemblerError(token, "out of memory");
+        }
+        state->forwardrefs = refs;
+    }
     state->forwardrefs[state->forwardsize++] = (struct _ForwardRef) {
         .line = token->line,
         .col = token->col,
         .addr = pc,
         .symbol = symbol,
     };
+    return 0;
 }
 
 
@@ -955,9 +1069,8 @@ static int _MtmcAssemblerTryResolveAddress(struct AssemblerState* state,
             return 0;
         }
         case AsmTokenType_identifier:
-            _MtmcAssemblerAddForwardReference(state, token);
             *addr = 0;
-            return 0;
+            return _MtmcAssemblerAddForwardReference(state, token);
         default:
             return _AssemblerError(token, "invalid address");
     }
@@ -1017,7 +1130,15 @@ static int _MtmcAssemblerEmitInstruction(struct AssemblerState* state,
                     }
                     break;
                 }
-                case MtmcInstructionMisc_mcp:
+                case MtmcInstructionMisc_mcp: {
+                    int res = _MtmcAssemblerParseRegister(&args[0], &nib1);
+                    if (res != 0) { return res; }
+                    res = _MtmcAssemblerParseRegister(&args[1], &nib0);
+                    if (res != 0) { return res; }
+                    res = _MtmcAssemblerParseNumber(&args[2], &word1);
+                    if (res != 0) { return res; }
+                    break;
+                }
                 case MtmcInstructionMisc_debug:
                     return _AssemblerError(token, "unhandled MISC instruction");
 
@@ -1241,11 +1362,13 @@ static int _MtmcAssemblerEmitInstruction(struct AssemblerState* state,
 
 int MtmcAssemblerCompileSource(FILE* source, struct MtmcExeObject* exe,
     const char* source_path) {
+    _AsmArenaReset(&_MtmcAsmArena);
     struct AssemblerState ams = (struct AssemblerState) {
         .source = source,
         .line = 1,
         .col = 0,
         .exe = exe,
+        .arena = &_MtmcAsmArena,
     };
     struct AsmToken token = {};
     const struct _AsmInstr* instr = NULL;
@@ -1467,6 +1590,12 @@ int MtmcAssemblerCompileSource(FILE* source, struct MtmcExeObject* exe,
 }
 
 
+/* Frees the tables kept for reuse by the calling thread. */
+void MtmcAssemblerReleaseMemory(void) {
+    _AsmArenaDeinit(&_MtmcAsmArena);
+}
+
+
 #ifdef PAIV_JSON_NUMBER_BACKEND_TYPE
 
 
@@ -1498,38 +1627,16 @@ int _json_writer_write_pair_str_arr(JSON* context, const char* key,
     err = json_writer_write_object_key_separator(context);
     _assert_json_ok(err, "json_writer_write_object_key_separator");
 
-    JSON ar;
-    err = json_writer_open_array(context, &ar);
-    _assert_json_ok(err, "json_writer_open_array");
-
-    for (size_t i = 0; i < bufsize; ++i) {
-        err = json_writer_write_array_value_separator(&ar);
-        _assert_json_ok(err, "json_writer_write_array_value_separator");
-
-        err = json_writer_write_numberi(&ar, (i8) buf[i]);
-        _assert_json_ok(err, "json_writer_write_numberi");
-    }
-
-    err = json_writer_close_array(&ar);
-    _assert_json_ok(err, "json_writer_close_array");
+    err = json_writer_write_int_array(context, JsonIntType_i8, buf, bufsize);
+    _assert_json_ok(err, "json_writer_write_int_array");
     return JsonError_ok;
 }
 
 
 static JsonError _json_writer_write_array(JSON* context,
     const u8* buf, size_t bufsize) {
-    JSON ar;
-    JsonError err = json_writer_open_array(context, &ar);
-    _assert_json_ok(err, "json_writer_open_array");
-    const u8* p = buf;
-    for (size_t i = 0; i < bufsize; ++i, ++p) {
-        err = json_writer_write_array_value_separator(&ar);
-        _assert_json_ok(err, "json_writer_write_array_value_separator");
-        err = json_writer_write_numberi(&ar, (i8)*p);
-        _assert_json_ok(err, "json_writer_write_numberi");
-    }
-    err = json_writer_close_array(&ar);
-    _assert_json_ok(err, "json_writer_close_array");
+    JsonError err = json_writer_write_int_array(context, JsonIntType_i8, buf, bufsize);
+    _assert_json_ok(err, "json_writer_write_int_array");
     return JsonError_ok;
 }
 
@@ -1595,14 +1702,12 @@ static JsonError _MtmcAssemblerLinkGraphics(JSON* context,
 }
 
 
-int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output) {
-    JSON context, obj;
-    JsonError err = json_writer_init(&context, output);
-    _assert_json_ok(err, "json_writer_init");
-    err = json_writer_open_object(&context, &obj);
+static int _MtmcAssemblerLinkJson(JSON* json, struct MtmcExeObject* exe) {
+    JSON obj;
+    JsonError err = json_writer_open_object(json, &obj);
     _assert_json_ok(err, "json_writer_open_object");
 
-    err = json_writer_write_object_value_separator(&context);
+    err = json_writer_write_object_value_separator(json);
     _assert_json_ok(err, "json_writer_write_object_value_separator");
 
     switch (exe->format) {
@@ -1616,14 +1721,14 @@ int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output) {
             return 1;
     }
 
-    err = json_writer_write_object_value_separator(&context);
+    err = json_writer_write_object_value_separator(json);
     _assert_json_ok(err, "json_writer_write_object_value_separator");
 
     err = _json_writer_write_pair_str_arr(&obj,
         "code", exe->code, exe->codesize);
     if (err != JsonError_ok) { return err; }
 
-    err = json_writer_write_object_value_separator(&context);
+    err = json_writer_write_object_value_separator(json);
     _assert_json_ok(err, "json_writer_write_object_value_separator");
 
     err = _json_writer_write_pair_str_arr(&obj,
@@ -1631,10 +1736,10 @@ int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output) {
     if (err != JsonError_ok) { return err; }
 
     if (exe->graphics_count > 0) {
-        err = json_writer_write_object_value_separator(&context);
+        err = json_writer_write_object_value_separator(json);
         _assert_json_ok(err, "json_writer_write_object_value_separator");
 
-        err = _MtmcAssemblerLinkGraphics(&context, "graphics", exe);
+        err = _MtmcAssemblerLinkGraphics(json, "graphics", exe);
         if (err != JsonError_ok) { return err; }
     }
 
@@ -1643,6 +1748,19 @@ int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output) {
     return 0;
 }
 
+
+int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output) {
+    JSON json;
+    JsonStream stream;
+    JsonError err = json_writer_init_buffered(&json, &stream, output, 0, NULL);
+    _assert_json_ok(err, "json_writer_init_buffered");
+    int res = _MtmcAssemblerLinkJson(&json, exe);
+    err = json_writer_close(&json);
+    if (res != 0) { return res; }
+    _assert_json_ok(err, "json_writer_close");
+    return 0;
+}
+
 #endif /* PAIV_JSON_ */
 
 
@@ -1667,6 +1785,26 @@ int MtmcAssemble(FILE* source, FILE* output, const char* source_filename) {
 }
 
 
+static int _MtmcDisassembleGraphics(struct MtmcExecutable* exe, const char* name) {
+    char filename[PATH_MAX];
+    struct MtmcGraphic graphic;
+    for (size_t i = 0; i < exe->graphics.count; ++i) {
+        snprintf(filename, sizeof(filename), "%s_graphic%zu.png", name, i);
+        fprintf(stderr, "%s\n", filename);
+        FILE* file = fopen(filename, "wb");
+        if (file == NULL) {
+            perror("fopen");
+            return 1;
+        }
+        MtmcSpriteAtlasGetGraphic(&exe->graphics, i, &graphic);
+        int res = MtmcGraphicWrite(&graphic, file);
+        fclose(file);
+        if (res != 0) { return res; }
+    }
+    return 0;
+}
+
+
 int MtmcDisassemble(FILE* input, FILE* output, const char* input_filename,
     int code_bytes, int graphics) {
     const char* name = "";
@@ -1676,27 +1814,16 @@ int MtmcDisassemble(FILE* input, FILE* output, const char* input_filename,
             name = sep + 1;
         }
     }
-    struct MtmcExecutable exe;
+    struct MtmcExecutable exe = {};
     int res = MtmcExecutableLoad(input, &exe);
-    if (res != 0) { return res; }
-    res = MtmcDecompileExecutable(&exe, output, code_bytes);
-    if (res != 0) { return res; }
-    if (graphics != 0) {
-        char filename[PATH_MAX];
-        for (size_t i = 0; i < exe.graphics_count; ++i) {
-            snprintf(filename, sizeof(filename), "%s_graphic%zu.png", name, i);
-            fprintf(stderr, "%s\n", filename);
-            FILE* file = fopen(filename, "wb");
-            if (file == NULL) {
-                perror("fopen");
-                return 1;
-            }
-            int res = MtmcGraphicWrite(&exe.graphics[i], file);
-            fclose(file);
-            if (res != 0) { return res; }
-        }
+    if (res == 0) {
+        res = MtmcDecompileExecutable(&exe, output, code_bytes);
     }
-    return 0;
+    if (res == 0 && graphics != 0) {
+        res = _MtmcDisassembleGraphics(&exe, name);
+    }
+    MtmcExecutableDeinit(&exe);
+    return res;
 }
 
 
@@ -1899,12 +2026,20 @@ static int _MtmcDasmPrintString(FILE* output, const u8* buf, size_t bufsize,
 }
 
 
+/* Code is sized to the executable, a truncated word reads as zero. */
+static u16 _MtmcDasmCodeWord(const struct MtmcExecutable* exe, size_t pc) {
+    u16 hi = (pc < exe->codesize) ? exe->code[pc] : 0;
+    u16 lo = (pc + 1 < exe->codesize) ? exe->code[pc + 1] : 0;
+    return (hi << 8) | lo;
+}
+
+
 int MtmcDecompileExecutable(struct MtmcExecutable* exe, FILE* output,
     int code_bytes) {
     for (size_t pc = 0; pc < exe->codesize;) {
         u16 addr = pc;
-        u16 opcode = (u16)exe->code[pc++] << 8;
-        opcode |= (u16)exe->code[pc++];
+        u16 opcode = _MtmcDasmCodeWord(exe, pc);
+        pc += 2;
         fprintf(output, "%04X: ", addr);
         if (code_bytes != 0) {
             fprintf(output, "%04x  ", opcode);
@@ -2082,8 +2217,8 @@ int MtmcDecompileExecutable(struct MtmcExecutable* exe, FILE* output,
                     break;
             }
             if (instr->dword != 0) {
-                i16 word = (u16)exe->code[pc++] << 8;
-                word |= (u16)exe->code[pc++];
+                i16 word = _MtmcDasmCodeWord(exe, pc);
+                pc += 2;
                 if (word >= (int)exe->codesize && word < (int)(exe->codesize + exe->datasize)) {
                     fprintf(output, " 0x%04x  # data[%d]", (int)word,
                         (int)(word - exe->codesize));
@@ -14,7 +14,7 @@
 
 
 static const char _usage[] =
-    "usage: mtmc16 [-h] {run,asm,disasm,img} ...\n";
+    "usage: mtmc16 [-h] {run,asm,disasm,img,mkdisk} ...\n";
 
 static const char _help_page[] =
     "usage: mtmc16 [-h] {run,asm,disasm} ...\n"
@@ -28,16 +28,25 @@ static const char _help_page[] =
     "    asm          assemble binary\n"
     "    disasm       disassemble binary\n"
     "    img          preprocess graphics\n"
+    "    mkdisk       pack disk image\n"
     "\n"
     "options:\n"
     "  -h, --help            show this help\n"
     ;
 
 static const char _run_usage[] =
-    "usage: mtmc16 run [-h] [-s SPEED] [-t TRACE] [-x SCALE] FILE [arg]\n";
+    "usage: mtmc16 run [-h] [-s SPEED] [-t TRACE] [-x SCALE] [--seed SEED]\n"
+    "                  [--virtual-clock] [--max-steps N] [--max-time MS]\n"
+    "                  [--max-syscalls N] [--max-output N] [--expect FILE]\n"
+    "                  [--record LOG] [--replay LOG] [--disk IMAGE]\n"
+    "                  [--dump-disk FILE] FILE [arg]\n";
 
 static const char _run_help_page[] =
-    "usage: mtmc16 run [-h] [-s SPEED] [-t TRACE] [-x SCALE] FILE [arg]\n"
+    "usage: mtmc16 run [-h] [-s SPEED] [-t TRACE] [-x SCALE] [--seed SEED]\n"
+    "                  [--virtual-clock] [--max-steps N] [--max-time MS]\n"
+    "                  [--max-syscalls N] [--max-output N] [--expect FILE]\n"
+    "                  [--record LOG] [--replay LOG] [--disk IMAGE]\n"
+    "                  [--dump-disk FILE] FILE [arg]\n"
     "\n"
     "positional arguments:\n"
     "  FILE                  executable binary\n"
@@ -47,6 +56,17 @@ static const char _run_help_page[] =
     "  -s, --speed SPEED     CPU speed in cycles per second\n"
     "  -t, --trace TRACE     tracing level\n"
     "  -x, --scale SCALE     scale window\n"
+    "  --seed SEED           random number generator seed\n"
+    "  --virtual-clock       derive timer and sleep from executed instructions\n"
+    "  --max-steps N         stop after N instructions\n"
+    "  --max-time MS         stop after MS milliseconds\n"
+    "  --max-syscalls N      stop after N system calls\n"
+    "  --max-output N        stop after N bytes of output\n"
+    "  --expect FILE         stop on the first output byte that differs from FILE\n"
+    "  --record LOG          log input syscall results to LOG\n"
+    "  --replay LOG          feed input syscall results from LOG, headless\n"
+    "  --disk IMAGE          serve files from a disk image instead of ./disk\n"
+    "  --dump-disk FILE      write files changed by the program to FILE on exit\n"
     "  -h, --help            show this help\n"
     ;
 
@@ -99,12 +119,30 @@ static const char _img_help_page[] =
     ;
 
 
+static const char _mkdisk_usage[] =
+    "usage: mtmc16 mkdisk [-h] [-o OUT] DIR\n";
+
+static const char _mkdisk_help_page[] =
+    "usage: mtmc16 mkdisk [-h] [-o OUT] DIR\n"
+    "\n"
+    "Pack a directory tree into a read-only disk image\n"
+    "\n"
+    "positional arguments:\n"
+    "  DIR                   disk directory\n"
+    "\n"
+    "options:\n"
+    "  -h, --help            show this help\n"
+    "  -o, --output OUT      output filename\n"
+    ;
+
+
 enum AppMode {
     AppMode_none,
     AppMode_run,
     AppMode_asm,
     AppMode_disasm,
     AppMode_img,
+    AppMode_mkdisk,
 };
 
 
@@ -112,19 +150,28 @@ struct AppArgs {
     int needs_help;
     enum AppMode app_mode;
     int run_needs_help;
-    int run_speed;
-    int run_trace_level;
+    struct MtmcRunOptions run_options;
     int run_window_scale;
+    const char* run_expect;
+    const char* run_record;
+    const char* run_replay;
+    const char* run_disk;
+    const char* run_dump;
     int asm_needs_help;
     int disasm_needs_help;
     int disasm_code_bytes;
     int disasm_graphics;
     int img_needs_help;
+    int mkdisk_needs_help;
     const char* input;
     const char* input_arg;
     const char* output;
     FILE* input_file;
     FILE* output_file;
+    FILE* expect_file;
+    FILE* record_file;
+    FILE* replay_file;
+    FILE* dump_file;
 };
 
 
@@ -145,6 +192,8 @@ static int
 parse_args(int argc, const char* argv[], struct AppArgs* args) {
     *args = (struct AppArgs) {};
     int state = 0;
+    const char* option = NULL;
+    const char** value = NULL;
 
     for (int i = 1; i < argc; ++i) {
         switch (state) {
@@ -169,12 +218,16 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                     args->app_mode = AppMode_img;
                     state = 4;
                 }
+                else if (strcmp(argv[i], "mkdisk") == 0) {
+                    args->app_mode = AppMode_mkdisk;
+                    state = 5;
+                }
                 else if (strncmp(argv[i], "-", 1) == 0) {
-                    arg_error(_usage, "the following arguments are required: {run,asm,disasm,img}");
+                    arg_error(_usage, "the following arguments are required: {run,asm,disasm,img,mkdisk}");
                     return 1;
                 }
                 else {
-                    arg_error(_usage, "argument {run,asm,disasm,img}: invalid choice: '%s'", argv[i]);
+                    arg_error(_usage, "argument {run,asm,disasm,img,mkdisk}: invalid choice: '%s'", argv[i]);
                     return 1;
                 }
                 break;
@@ -196,6 +249,49 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                     strcmp(argv[i], "--scale") == 0) {
                     state = 13;
                 }
+                else if (strcmp(argv[i], "--max-steps") == 0) {
+                    state = 14;
+                }
+                else if (strcmp(argv[i], "--max-time") == 0) {
+                    state = 15;
+                }
+                else if (strcmp(argv[i], "--max-syscalls") == 0) {
+                    state = 16;
+                }
+                else if (strcmp(argv[i], "--max-output") == 0) {
+                    state = 17;
+                }
+                else if (strcmp(argv[i], "--expect") == 0) {
+                    option = argv[i];
+                    value = &args->run_expect;
+                    state = 18;
+                }
+                else if (strcmp(argv[i], "--record") == 0) {
+                    option = argv[i];
+                    value = &args->run_record;
+                    state = 18;
+                }
+                else if (strcmp(argv[i], "--replay") == 0) {
+                    option = argv[i];
+                    value = &args->run_replay;
+                    state = 18;
+                }
+                else if (strcmp(argv[i], "--disk") == 0) {
+                    option = argv[i];
+                    value = &args->run_disk;
+                    state = 18;
+                }
+                else if (strcmp(argv[i], "--dump-disk") == 0) {
+                    option = argv[i];
+                    value = &args->run_dump;
+                    state = 18;
+                }
+                else if (strcmp(argv[i], "--seed") == 0) {
+                    state = 10;
+                }
+                else if (strcmp(argv[i], "--virtual-clock") == 0) {
+                    args->run_options.virtual_clock = 1;
+                }
                 else if (strncmp(argv[i], "-", 1) == 0) {
                     arg_error(_run_usage, "unrecognized arguments: %s", argv[i]);
                     return 1;
@@ -206,6 +302,18 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                 }
                 break;
 
+            case 10: {
+                char* end = NULL;
+                unsigned long long x = strtoull(argv[i], &end, 0);
+                if (end != argv[i] + strlen(argv[i])) {
+                    arg_error(_run_usage, "invalid integer value: %s", argv[i]);
+                    return 1;
+                }
+                args->run_options.seed = x;
+                state = 1;
+                break;
+            }
+
             case 11: {
                 char* end = NULL;
                 long x = strtol(argv[i], &end, 10);
@@ -213,7 +321,7 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                     arg_error(_run_usage, "invalid integer value: %s", argv[i]);
                     return 1;
                 }
-                args->run_speed = x > 0 ? x : Mtmc_DEFAULT_SPEED;
+                args->run_options.speed = x > 0 ? x : Mtmc_DEFAULT_SPEED;
                 state = 1;
                 break;
             }
@@ -225,7 +333,7 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                     arg_error(_run_usage, "invalid integer value: %s", argv[i]);
                     return 1;
                 }
-                args->run_trace_level = x >= 0 ? x : 0;
+                args->run_options.trace_level = x >= 0 ? x : 0;
                 state = 1;
                 break;
             }
@@ -242,6 +350,32 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                 break;
             }
 
+            case 14:
+            case 15:
+            case 16:
+            case 17: {
+                char* end = NULL;
+                long long x = strtoll(argv[i], &end, 10);
+                if (end != argv[i] + strlen(argv[i])) {
+                    arg_error(_run_usage, "invalid integer value: %s", argv[i]);
+                    return 1;
+                }
+                size_t limit = x > 0 ? x : 0;
+                switch (state) {
+                    case 14: args->run_options.budget.instructions = limit; break;
+                    case 15: args->run_options.budget.milliseconds = limit; break;
+                    case 16: args->run_options.budget.syscalls = limit; break;
+                    case 17: args->run_options.budget.output = limit; break;
+                }
+                state = 1;
+                break;
+            }
+
+            case 18:
+                *value = argv[i];
+                state = 1;
+                break;
+
             case 19:
                 args->input_arg = argv[i];
                 break;
@@ -337,6 +471,34 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
             case 49:
                 arg_error(_img_usage, "extra arguments: %s", argv[i]);
                 break;
+
+            case 5:
+                if (strcmp(argv[i], "-h") == 0 ||
+                    strcmp(argv[i], "--help") == 0) {
+                    args->mkdisk_needs_help = 1;
+                }
+                else if (strcmp(argv[i], "-o") == 0 ||
+                    strcmp(argv[i], "--output") == 0) {
+                    state = 51;
+                }
+                else if (strncmp(argv[i], "-", 1) == 0) {
+                    arg_error(_mkdisk_usage, "unrecognized arguments: %s", argv[i]);
+                    return 1;
+                }
+                else {
+                    args->input = argv[i];
+                    state = 59;
+                }
+                break;
+
+            case 51:
+                args->output = argv[i];
+                state = 5;
+                break;
+
+            case 59:
+                arg_error(_mkdisk_usage, "extra arguments: %s", argv[i]);
+                break;
         }
     }
 
@@ -344,11 +506,15 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
         args->run_needs_help != 0 ||
         args->asm_needs_help != 0 ||
         args->disasm_needs_help != 0 ||
-        args->img_needs_help != 0) {
+        args->img_needs_help != 0 ||
+        args->mkdisk_needs_help != 0) {
         return 0;
     }
 
     switch (state) {
+        case 10:
+            arg_error(_run_usage, "argument --seed: expected a value");
+            return 1;
         case 11:
             arg_error(_run_usage, "argument -s/--speed: expected a value");
             return 1;
@@ -358,6 +524,21 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
         case 13:
             arg_error(_run_usage, "argument -x/--scale: expected a value");
             return 1;
+        case 14:
+            arg_error(_run_usage, "argument --max-steps: expected a value");
+            return 1;
+        case 15:
+            arg_error(_run_usage, "argument --max-time: expected a value");
+            return 1;
+        case 16:
+            arg_error(_run_usage, "argument --max-syscalls: expected a value");
+            return 1;
+        case 17:
+            arg_error(_run_usage, "argument --max-output: expected a value");
+            return 1;
+        case 18:
+            arg_error(_run_usage, "argument %s: expected a value", option);
+            return 1;
         case 21:
             arg_error(_asm_usage, "argument -o/--output: expected a value");
             return 1;
@@ -367,11 +548,14 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
         case 41:
             arg_error(_img_usage, "argument -o/--output: expected a value");
             return 1;
+        case 51:
+            arg_error(_mkdisk_usage, "argument -o/--output: expected a value");
+            return 1;
     }
 
     switch (args->app_mode) {
         case AppMode_none:
-            arg_error(_usage, "the following arguments are required: {run,asm,disasm,img}");
+            arg_error(_usage, "the following arguments are required: {run,asm,disasm,img,mkdisk}");
             return 1;
 
         case AppMode_run:
@@ -401,6 +585,13 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                 return 1;
             }
             break;
+
+        case AppMode_mkdisk:
+            if (args->input == NULL) {
+                arg_error(_mkdisk_usage, "the following arguments are required: DIR");
+                return 1;
+            }
+            break;
     }
 
     return 0;
@@ -438,27 +629,78 @@ args_open_file(const char* filename, const char* mode, FILE** file) {
 
 static void
 args_close_files(struct AppArgs* args) {
-    if (args->input_file != stdin) {
+    if (args->input_file != NULL && args->input_file != stdin) {
         fclose(args->input_file);
     }
-    if (args->output_file != stdout) {
+    if (args->output_file != NULL && args->output_file != stdout) {
         fclose(args->output_file);
     }
+    if (args->expect_file != NULL && args->expect_file != stdin) {
+        fclose(args->expect_file);
+    }
+    if (args->record_file != NULL && args->record_file != stdout) {
+        fclose(args->record_file);
+    }
+    if (args->replay_file != NULL && args->replay_file != stdin) {
+        fclose(args->replay_file);
+    }
+    if (args->dump_file != NULL && args->dump_file != stdout) {
+        fclose(args->dump_file);
+    }
+}
+
+
+struct AppRunTask {
+    PlatformState platform;
+    FILE* file;
+    const char* arg;
+    const struct MtmcRunOptions* options;
+};
+
+
+static int
+app_run_task(void* context) {
+    struct AppRunTask* task = context;
+    return MtmcPlatformRun(task->platform, task->file, task->arg,
+        task->options);
 }
 
 
 static int
-app_run(FILE* file, const char* arg, int speed, int trace_level, int scale) {
+app_run(FILE* file, const char* arg, const struct MtmcRunOptions* options,
+    int scale, FILE* expect, const char* disk, FILE* dump) {
     struct Platform platform = {
         .screen_width = MtmcDisplay_width,
         .screen_height = MtmcDisplay_height,
         .screen_scale = scale,
+        /* replay draws without a display */
+        .headless = options->replay != NULL,
     };
     int res = PlatformInit(&platform);
     if (res != 0) { return res; }
-    PlatformRandomSeed(&platform, time(NULL));
+    if (expect != NULL) {
+        PlatformSetExpectedOutput(&platform, expect);
+    }
+    if (disk != NULL) {
+        res = PlatformSetDiskImage(&platform, disk);
+        if (res != 0) {
+            PlatformDeinit(&platform);
+            return res;
+        }
+    }
 
-    res = MtmcPlatformRun(&platform, file, arg, speed, trace_level);
+    struct AppRunTask task = {
+        .platform = &platform,
+        .file = file,
+        .arg = arg,
+        .options = options,
+    };
+    res = PlatformRunLoop(&platform, app_run_task, &task);
+    if (dump != NULL) {
+        PlatformFlushOutput(&platform);
+        int err = PlatformDumpOverlay(&platform, dump);
+        if (res == 0) { res = err; }
+    }
 
     PlatformDeinit(&platform);
     return res;
@@ -481,6 +723,12 @@ app_disasm(FILE* input, FILE* output, const char* input_filename,
 }
 
 
+static int
+app_mkdisk(const char* root, FILE* output) {
+    return PlatformWriteDiskImage(root, output);
+}
+
+
 static int
 app_img(FILE* input, FILE* output) {
     struct MtmcGraphic graphic;
@@ -496,6 +744,7 @@ int main(int argc, const char* argv[]) {
     setlocale(LC_ALL, "");
 
     struct AppArgs args = {};
+    args.run_options.seed = time(NULL);
     int res = parse_args(argc, argv, &args);
     if (res != 0) { return res; }
 
@@ -524,18 +773,45 @@ int main(int argc, const char* argv[]) {
         return 0;
     }
 
-    res = args_open_file(args.input, "rb", &args.input_file);
-    if (res != 0) { return res; }
+    if (args.mkdisk_needs_help) {
+        puts(_mkdisk_help_page);
+        return 0;
+    }
+
+    if (args.app_mode != AppMode_mkdisk) {
+        res = args_open_file(args.input, "rb", &args.input_file);
+        if (res != 0) { return res; }
+    }
 
     switch (args.app_mode) {
         case AppMode_none:
             break;
 
         case AppMode_run:
+            if (args.run_expect != NULL) {
+                res = args_open_file(args.run_expect, "rb", &args.expect_file);
+                if (res != 0) { return res; }
+            }
+            if (args.run_record != NULL) {
+                res = args_open_file(args.run_record, "wb", &args.record_file);
+                if (res != 0) { return res; }
+                args.run_options.record = args.record_file;
+            }
+            if (args.run_replay != NULL) {
+                res = args_open_file(args.run_replay, "rb", &args.replay_file);
+                if (res != 0) { return res; }
+                args.run_options.replay = args.replay_file;
+            }
+            if (args.run_dump != NULL) {
+                res = args_open_file(args.run_dump, "wb", &args.dump_file);
+                if (res != 0) { return res; }
+            }
             res = app_run(args.input_file, args.input_arg,
-                args.run_speed,
-                args.run_trace_level,
-                args.run_window_scale);
+                &args.run_options,
+                args.run_window_scale,
+                args.expect_file,
+                args.run_disk,
+                args.dump_file);
             break;
 
         case AppMode_asm:
@@ -558,6 +834,12 @@ int main(int argc, const char* argv[]) {
             if (res != 0) { return res; }
             res = app_img(args.input_file, args.output_file);
             break;
+
+        case AppMode_mkdisk:
+            res = args_open_file(args.output, "wb", &args.output_file);
+            if (res != 0) { return res; }
+            res = app_mkdisk(args.input, args.output_file);
+            break;
     }
 
     args_close_files(&args);
@@ -1,47 +1,201 @@
 #include <dirent.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #define GL_SILENCE_DEPRECATION
 #include <OpenGL/gl3.h>
 #include <GLFW/glfw3.h>
 #include "shaders.c"
 
 
-typedef uint64_t u64;
+/* Read-only disk image: header, hash table of entry index + 1 by path,
+   entries in breadth-first order so each directory lists its children
+   contiguously and sorted, then paths and file data. Host byte order. */
+struct PlatformDiskHeader {
+    char magic[8];
+    u32 count;
+    u32 buckets;
+};
+
+
+struct PlatformDiskEntry {
+    /* NUL-terminated absolute path, and its last component */
+    u32 path;
+    u32 name;
+    u32 flags;
+    /* file data, or the first child of a directory */
+    u32 offset;
+    /* file size, or the number of children */
+    u32 size;
+};
+
+
+static const char _PlatformDiskMagic[8] = "MTMCDSK1";
+
+
+struct PlatformDirEntry {
+    size_t name;
+    size_t size;
+    i16 flags;
+};
+
+
+/* File written or deleted by the program, offsets into the arena */
+struct PlatformOverlayFile {
+    size_t path;
+    size_t data;
+    size_t size;
+    size_t capacity;
+    int deleted;
+};
+
+
+enum PlatformOutputFlush {
+    /* newline and read on a terminal, read otherwise */
+    PlatformOutputFlush_auto = 0,
+    PlatformOutputFlush_newline = 1 << 0,
+    PlatformOutputFlush_read = 1 << 1,
+    /* only when full, and on exit, overrides the events above */
+    PlatformOutputFlush_threshold = 1 << 2,
+};
 
 
 struct Platform {
     i16 screen_width;
     i16 screen_height;
-    i16 buttons;
+    /* published by event thread, keyboard and gamepads combined */
+    atomic_int buttons;
+    i16 keys;
+    i16 gamepads;
+    /* connected at the last poll, events are waited for without a timeout
+       when there are none */
+    int gamepads_connected;
     int screen_scale;
+    /* draw into the canvas only, never touching GLFW */
+    int headless;
     GLFWwindow* window;
+    /* back buffer of the frames triple buffer, owned by emulator */
     GLubyte* canvas;
+    GLubyte* frames;
+    int frame_back;
+    int frame_front;
+    atomic_int frame_ready;
+    atomic_int framebuffer_width;
+    atomic_int framebuffer_height;
+    atomic_bool rendering;
+    atomic_bool screenshot;
+    pthread_t renderer;
+    /* render thread sleeps here until there is something to present */
+    pthread_mutex_t render_lock;
+    pthread_cond_t render_signal;
     GLuint glprogram;
     GLuint glarray;
     GLuint glcanvas;
     size_t glcanvassize;
-    u8 closed;
+    atomic_bool closed;
+    /* set when GLFW events are owned by PlatformRunLoop */
+    int events;
+    int finished;
+    int window_requested;
+    pthread_mutex_t lock;
+    pthread_cond_t signal;
     i16 color;
-    u16 randstate[4];
     struct timespec timer;
     char cwd[PATH_MAX];
+    /* disk root, opened once, all lookups walk down from it */
+    int disk_fd;
+    int disk_ready;
+    /* mapped disk image, serves file syscalls instead of ./disk */
+    const u8* disk_image;
+    size_t disk_image_size;
+    /* sorted listing of the last directory read */
+    char dir_path[PATH_MAX];
+    dev_t dir_dev;
+    ino_t dir_ino;
+    struct timespec dir_mtime;
+    int dir_racy;
+    size_t dir_count;
+    struct PlatformDirEntry* dir_entries;
+    char* dir_names;
+    u64 dir_loads;
+    /* copy-on-write layer over the disk: files written and deleted by
+       the program, with paths and data in an append-only arena */
+    size_t overlay_count;
+    size_t overlay_capacity;
+    struct PlatformOverlayFile* overlay;
+    u8* overlay_arena;
+    size_t overlay_arena_size;
+    size_t overlay_arena_capacity;
+    u64 overlay_version;
+    /* merged listing of the last directory changed in the overlay */
+    char overlay_dir[PATH_MAX];
+    u64 overlay_dir_version;
+    u64 overlay_dir_loads;
+    size_t overlay_dir_count;
+    struct PlatformDirEntry* overlay_dir_entries;
+    char* overlay_dir_names;
+    size_t overlay_dir_names_capacity;
+    /* console output buffer, stdout by default */
+    FILE* output_file;
+    int output_flush;
+    int output_capture;
+    size_t output_threshold;
+    size_t output_total;
+    size_t output_size;
+    size_t output_capacity;
+    char* output;
+    /* console input, stdin by default, or a memory buffer */
+    FILE* input_file;
+    const char* input_data;
+    size_t input_position;
+    size_t input_size;
+    int input_memory;
+    int input_eof;
+    char* input;
+    /* expected console output, compared as it is written */
+    FILE* expect_file;
+    const char* expect_data;
+    size_t expect_position;
+    size_t expect_size;
+    size_t expect_offset;
+    int expect_memory;
+    int expect_mismatch;
+    char* expect;
 };
 
 
 enum {
     _Padding = 1,
     _DefaultScale = 4,
+    _FrameIndex = 0x3,
+    _FrameFresh = 0x4,
+    _OutputThreshold = 4096,
+    _InputBufferSize = 64 * 1024,
+    _OverlayArenaSize = 4096,
+    _OverlayFilesSize = 16,
 };
 
 
+static const double _GamepadPollInterval = 0.004;
+
+
+static void _TakeScreenshot(PlatformState state);
+void PlatformFlushOutput(PlatformState state);
+int PlatformSetDiskImage(PlatformState state, const char* filename);
+
+
 static void _PlatformDrawWindow(PlatformState state) {
-    int w, h;
-    glfwGetFramebufferSize(state->window, &w, &h);
+    int w = atomic_load(&state->framebuffer_width);
+    int h = atomic_load(&state->framebuffer_height);
     glViewport(0, 0, w, h);
 
     glClear(GL_COLOR_BUFFER_BIT);
@@ -50,14 +204,86 @@ static void _PlatformDrawWindow(PlatformState state) {
     float s = state->screen_scale > 3 ? 0.9 : 1;
     glPointSize((float)w / (2 * _Padding + state->screen_width) * s);
     glDrawArrays(GL_POINTS, 0, state->screen_width * state->screen_height);
-    glfwSwapBuffers(state->window);
 }
 
 
+/* Owns the GL context. Presents the latest frame published by
+   the emulator, paced by vsync, and sleeps while there is none. */
+static void* _PlatformRenderThread(void* arg) {
+    PlatformState state = arg;
+    glfwMakeContextCurrent(state->window);
+    glfwSwapInterval(1);
+
+    for (;;) {
+        pthread_mutex_lock(&state->render_lock);
+        while (atomic_load(&state->rendering) &&
+            (atomic_load(&state->frame_ready) & _FrameFresh) == 0 &&
+            atomic_load(&state->screenshot) == 0) {
+            pthread_cond_wait(&state->render_signal, &state->render_lock);
+        }
+        pthread_mutex_unlock(&state->render_lock);
+        if (atomic_load(&state->rendering) == 0) { break; }
+
+        int fresh = (atomic_load(&state->frame_ready) & _FrameFresh) != 0;
+        int screenshot = atomic_exchange(&state->screenshot, 0);
+        if (fresh != 0) {
+            int ready = atomic_exchange(&state->frame_ready, state->frame_front);
+            state->frame_front = ready & _FrameIndex;
+            glBindBuffer(GL_ARRAY_BUFFER, state->glcanvas);
+            glBufferData(GL_ARRAY_BUFFER, state->glcanvassize,
+                &state->frames[state->frame_front * state->glcanvassize],
+                GL_DYNAMIC_COPY);
+        }
+        _PlatformDrawWindow(state);
+        if (screenshot != 0) {
+            _TakeScreenshot(state);
+        }
+        glfwSwapBuffers(state->window);
+    }
+
+    glfwMakeContextCurrent(NULL);
+    return NULL;
+}
+
+
+/* Signals under the lock, so the render thread cannot miss a change
+   made between its check and its wait. */
+static void _PlatformWakeRenderer(PlatformState state) {
+    pthread_mutex_lock(&state->render_lock);
+    pthread_cond_signal(&state->render_signal);
+    pthread_mutex_unlock(&state->render_lock);
+}
+
+
+/* Hands the back buffer over to the render thread, and continues
+   drawing on a copy of it. */
+static void _PlatformPublishFrame(PlatformState state) {
+    int back = state->frame_back | _FrameFresh;
+    back = atomic_exchange(&state->frame_ready, back) & _FrameIndex;
+    _PlatformWakeRenderer(state);
+    GLubyte* canvas = &state->frames[back * state->glcanvassize];
+    memcpy(canvas, state->canvas, state->glcanvassize);
+    state->frame_back = back;
+    state->canvas = canvas;
+}
+
+
+static void _PlatformPollGamepads(PlatformState state);
+
+
 static void _PlatformRunloop(PlatformState state) {
-    glfwPollEvents();
+    _PlatformPollGamepads(state);
     if (glfwWindowShouldClose(state->window) != GLFW_FALSE) {
-        state->closed = 1;
+        atomic_store(&state->closed, 1);
+    }
+}
+
+
+/* Without PlatformRunLoop, events are pumped from syscalls. */
+static void _PlatformPumpEvents(PlatformState state) {
+    if (state->events == 0 && state->window != NULL) {
+        glfwPollEvents();
+        _PlatformRunloop(state);
     }
 }
 
@@ -69,7 +295,9 @@ static void _HandleError(int code, const char* description) {
 
 static void _HandleFramebufferSizeChange(GLFWwindow* window,
     int width, int height) {
-    glViewport(0, 0, width, height);
+    PlatformState state = glfwGetWindowUserPointer(window);
+    atomic_store(&state->framebuffer_width, width);
+    atomic_store(&state->framebuffer_height, height);
 }
 
 
@@ -150,33 +378,34 @@ static void _HandleKeyboard(GLFWwindow* window, int key, int scancode,
             break;
 
         case GLFW_KEY_UP:
-            _SetButton(&state->buttons, 0x80, action, mods); break;
+            _SetButton(&state->keys, 0x80, action, mods); break;
         case GLFW_KEY_DOWN:
-            _SetButton(&state->buttons, 0x40, action, mods); break;
+            _SetButton(&state->keys, 0x40, action, mods); break;
         case GLFW_KEY_LEFT:
-            _SetButton(&state->buttons, 0x20, action, mods); break;
+            _SetButton(&state->keys, 0x20, action, mods); break;
         case GLFW_KEY_RIGHT:
-            _SetButton(&state->buttons, 0x10, action, mods); break;
+            _SetButton(&state->keys, 0x10, action, mods); break;
         case GLFW_KEY_L:
-            _SetButton(&state->buttons, 0x08, action, mods); break;
+            _SetButton(&state->keys, 0x08, action, mods); break;
         case GLFW_KEY_SPACE:
-            _SetButton(&state->buttons, 0x04, action, mods); break;
+            _SetButton(&state->keys, 0x04, action, mods); break;
         case GLFW_KEY_A:
-            _SetButton(&state->buttons, 0x02, action, mods); break;
+            _SetButton(&state->keys, 0x02, action, mods); break;
         case GLFW_KEY_S:
             if ((mods & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER)) != 0) {
                 if (action == GLFW_PRESS) {
-                    _TakeScreenshot(state); break;
+                    atomic_store(&state->screenshot, 1);
+                    _PlatformWakeRenderer(state);
+                    break;
                 }
             }
-            _SetButton(&state->buttons, 0x01, action, mods); break;
+            _SetButton(&state->keys, 0x01, action, mods); break;
     }
+    atomic_store(&state->buttons, (u16)(state->keys | state->gamepads));
 }
 
 
-/*
-static void _HandleGamepad(GLFWwindow* window, int jid) {
-    PlatformState state = glfwGetWindowUserPointer(window);
+static void _HandleGamepad(PlatformState state, int jid) {
     GLFWgamepadstate gamepad;
     if (glfwGetGamepadState(jid, &gamepad) == GLFW_FALSE) {
         return;
@@ -192,20 +421,30 @@ static void _HandleGamepad(GLFWwindow* window, int jid) {
         GLFW_GAMEPAD_BUTTON_DPAD_UP,
     };
     for (size_t i = 0; i < 8; ++i) {
-        int action = gamepad.buttons[buttons[i]];
-        _SetButton(&state->buttons, (1 << i), action, 0);
+        if (gamepad.buttons[buttons[i]] == GLFW_PRESS) {
+            state->gamepads |= (1 << i);
+        }
     }
 }
 
 
+/* Connecting a gamepad ends glfwWaitEvents, and the run loop polls the
+   gamepads again after every wait. */
+static void _HandleJoystick(int jid, int event) {
+}
+
+
 static void _PlatformPollGamepads(PlatformState state) {
+    state->gamepads = 0;
+    state->gamepads_connected = 0;
     for (int i = 0; i <= GLFW_JOYSTICK_LAST; ++i) {
         if (glfwJoystickIsGamepad(i) != GLFW_FALSE) {
-            _HandleGamepad(state->window, i);
+            state->gamepads_connected += 1;
+            _HandleGamepad(state, i);
         }
     }
+    atomic_store(&state->buttons, (u16)(state->keys | state->gamepads));
 }
-*/
 
 
 static int _CheckShaderStatus(GLuint shader, const char* message) {
@@ -302,13 +541,16 @@ static int _PlatformCreateWindow(PlatformState state) {
     glfwSetWindowUserPointer(state->window, state);
     glfwSetFramebufferSizeCallback(state->window, _HandleFramebufferSizeChange);
     glfwSetKeyCallback(state->window, _HandleKeyboard);
+    glfwSetJoystickCallback(_HandleJoystick);
+    _PlatformPollGamepads(state);
 
     glfwMakeContextCurrent(state->window);
     glfwSetWindowAspectRatio(state->window, state->screen_width, state->screen_height);
 
-    #if 0
-    glfwSwapInterval(1);
-    #endif
+    int fbw, fbh;
+    glfwGetFramebufferSize(state->window, &fbw, &fbh);
+    atomic_store(&state->framebuffer_width, fbw);
+    atomic_store(&state->framebuffer_height, fbh);
 
     glClearColor(0, 0, 0, 1);
 
@@ -332,8 +574,11 @@ static int _PlatformCreateWindow(PlatformState state) {
 
     size_t canvas_size = state->screen_width * state->screen_height *
         sizeof(state->canvas[0]);
-    state->canvas = calloc(state->screen_width * state->screen_height,
-        sizeof(state->canvas[0]));
+    state->frames = calloc(3, canvas_size);
+    state->frame_back = 0;
+    state->frame_front = 1;
+    atomic_store(&state->frame_ready, 2);
+    state->canvas = &state->frames[state->frame_back * canvas_size];
     GLuint canvasid;
     glGenBuffers(1, &canvasid);
     glBindBuffer(GL_ARRAY_BUFFER, canvasid);
@@ -355,6 +600,59 @@ static int _PlatformCreateWindow(PlatformState state) {
     glEnableVertexAttribArray(1);
 
     glBindVertexArray(0);
+    glfwMakeContextCurrent(NULL);
+
+    pthread_mutex_init(&state->render_lock, NULL);
+    pthread_cond_init(&state->render_signal, NULL);
+    atomic_store(&state->rendering, 1);
+    res = pthread_create(&state->renderer, NULL, _PlatformRenderThread, state);
+    if (res != 0) {
+        /* no renderer means no window: tear it all down and report failure */
+        atomic_store(&state->rendering, 0);
+        fprintf(stderr, "pthread_create: %s\n", strerror(res));
+        pthread_cond_destroy(&state->render_signal);
+        pthread_mutex_destroy(&state->render_lock);
+        glfwDestroyWindow(state->window);
+        state->window = NULL;
+        glfwTerminate();
+        free(state->frames);
+        state->frames = NULL;
+        state->canvas = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+
+static int _PlatformEnsureWindow(PlatformState state) {
+    if (state->window != NULL) { return 0; }
+    if (state->headless != 0) {
+        if (state->canvas == NULL) {
+            state->color = MtmcDisplayColor_LIGHTEST;
+            state->glcanvassize = state->screen_width * state->screen_height *
+                sizeof(state->canvas[0]);
+            state->frames = calloc(1, state->glcanvassize);
+            state->canvas = state->frames;
+        }
+        return 0;
+    }
+    if (state->events == 0) {
+        _PlatformCreateWindow(state);
+    }
+    else {
+        pthread_mutex_lock(&state->lock);
+        state->window_requested = 1;
+        pthread_cond_broadcast(&state->signal);
+        while (state->window_requested != 0) {
+            pthread_cond_wait(&state->signal, &state->lock);
+        }
+        pthread_mutex_unlock(&state->lock);
+    }
+    if (state->window == NULL || state->canvas == NULL) {
+        /* the display is gone for good, stop the program like a closed window */
+        atomic_store(&state->closed, 1);
+        return 1;
+    }
     return 0;
 }
 
@@ -364,16 +662,137 @@ int PlatformInit(PlatformState state) {
 }
 
 
+struct _PlatformTask {
+    PlatformState state;
+    int (*run)(void*);
+    void* context;
+    int result;
+};
+
+
+static void* _PlatformTaskThread(void* arg) {
+    struct _PlatformTask* task = arg;
+    PlatformState state = task->state;
+    task->result = task->run(task->context);
+    pthread_mutex_lock(&state->lock);
+    state->finished = 1;
+    pthread_cond_broadcast(&state->signal);
+    if (state->window != NULL) {
+        glfwPostEmptyEvent();
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+
+/* Runs task on a separate thread, while the calling thread owns
+   the window and GLFW events, as required on macOS. */
+int PlatformRunLoop(PlatformState state, int (*run)(void*), void* context) {
+    struct _PlatformTask task = {
+        .state = state,
+        .run = run,
+        .context = context,
+        };
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->signal, NULL);
+    state->events = 1;
+    state->finished = 0;
+
+    pthread_t thread;
+    int res = pthread_create(&thread, NULL, _PlatformTaskThread, &task);
+    if (res != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(res));
+        state->events = 0;
+        return 1;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    for (;;) {
+        if (state->window_requested != 0) {
+            pthread_mutex_unlock(&state->lock);
+            _PlatformCreateWindow(state);
+            pthread_mutex_lock(&state->lock);
+            state->window_requested = 0;
+            pthread_cond_broadcast(&state->signal);
+        }
+        if (state->finished != 0) { break; }
+        if (state->window == NULL) {
+            pthread_cond_wait(&state->signal, &state->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&state->lock);
+        if (state->gamepads_connected != 0) {
+            glfwWaitEventsTimeout(_GamepadPollInterval);
+        }
+        else {
+            glfwWaitEvents();
+        }
+        _PlatformRunloop(state);
+        pthread_mutex_lock(&state->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    pthread_join(thread, NULL);
+    state->events = 0;
+    pthread_cond_destroy(&state->signal);
+    pthread_mutex_destroy(&state->lock);
+    return task.result;
+}
+
+
 void PlatformDeinit(PlatformState state) {
+    PlatformFlushOutput(state);
+    free(state->output);
+    state->output = NULL;
+    state->output_size = 0;
+    state->output_capacity = 0;
+    free(state->input);
+    state->input = NULL;
+    free(state->expect);
+    state->expect = NULL;
+    free(state->dir_entries);
+    free(state->dir_names);
+    state->dir_entries = NULL;
+    state->dir_names = NULL;
+    state->dir_path[0] = '\0';
+    state->dir_count = 0;
+    free(state->overlay);
+    free(state->overlay_arena);
+    free(state->overlay_dir_entries);
+    free(state->overlay_dir_names);
+    state->overlay = NULL;
+    state->overlay_arena = NULL;
+    state->overlay_dir_entries = NULL;
+    state->overlay_dir_names = NULL;
+    state->overlay_count = 0;
+    state->overlay_capacity = 0;
+    state->overlay_arena_size = 0;
+    state->overlay_arena_capacity = 0;
+    state->overlay_dir_names_capacity = 0;
+    state->overlay_dir[0] = '\0';
+    if (state->disk_ready != 0) {
+        close(state->disk_fd);
+        state->disk_ready = 0;
+    }
+    PlatformSetDiskImage(state, NULL);
     if (state->window != NULL) {
+        if (atomic_exchange(&state->rendering, 0) != 0) {
+            _PlatformWakeRenderer(state);
+            pthread_join(state->renderer, NULL);
+            pthread_cond_destroy(&state->render_signal);
+            pthread_mutex_destroy(&state->render_lock);
+        }
         glfwTerminate();
-        free(state->canvas);
+        state->window = NULL;
     }
+    free(state->frames);
+    state->frames = NULL;
+    state->canvas = NULL;
 }
 
 
 u8 PlatformIsClosed(PlatformState state) {
-    return state->closed;
+    return atomic_load(&state->closed);
 }
 
 
@@ -420,34 +839,39 @@ static double TimeElapsed(struct timespec* since) {
 void PlatformSleep(PlatformState state, i16 millis) {
     if (millis <= 0) { return; }
 
-    struct timespec start = TimeNow();
-    double total = millis / 1000.0;
+    if (state->events == 0 && state->window != NULL) {
+        struct timespec start = TimeNow();
+        double total = millis / 1000.0;
 
-    for (double timeout = total; timeout > 0.0005; ) {
-        glfwWaitEventsTimeout(timeout);
-        glfwPollEvents();
-        timeout = total - TimeElapsed(&start);
+        for (double timeout = total; timeout > 0.0005; ) {
+            glfwWaitEventsTimeout(timeout);
+            _PlatformRunloop(state);
+            timeout = total - TimeElapsed(&start);
+        }
+        return;
+    }
+
+    struct timespec delay = {
+        .tv_sec = millis / 1000,
+        .tv_nsec = (millis % 1000) * 1000000L,
+        };
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
     }
 }
 
 
 void PlatformResetFrame(PlatformState state) {
-    if (state->window == NULL) {
-        _PlatformCreateWindow(state);
-    }
+    if (_PlatformEnsureWindow(state) != 0) { return; }
     memset(state->canvas, MtmcDisplayColor_LIGHTEST, state->glcanvassize);
     state->color = MtmcDisplayColor_DARK;
 }
 
 
 void PlatformDrawFrame(PlatformState state) {
-    if (state->window == NULL) {
-        _PlatformCreateWindow(state);
-    }
-    glBindBuffer(GL_ARRAY_BUFFER, state->glcanvas);
-    glBufferData(GL_ARRAY_BUFFER, state->glcanvassize, state->canvas, GL_DYNAMIC_COPY);
-    _PlatformDrawWindow(state);
-    _PlatformRunloop(state);
+    if (_PlatformEnsureWindow(state) != 0) { return; }
+    if (state->window == NULL) { return; }
+    _PlatformPublishFrame(state);
+    _PlatformPumpEvents(state);
 }
 
 
@@ -458,9 +882,7 @@ void PlatformSetColor(PlatformState state, i16 color) {
 
 void PlatformFillRect(PlatformState state, i16 x, i16 y,
     i16 width, i16 height) {
-    if (state->window == NULL) {
-        _PlatformCreateWindow(state);
-    }
+    if (_PlatformEnsureWindow(state) != 0) { return; }
     for (i16 i = 0; i < width; ++i) {
         if ((i + x >= state->screen_width) || (i + x < 0)) { continue; }
         for (i16 j = 0; j < height; ++j) {
@@ -472,51 +894,332 @@ void PlatformFillRect(PlatformState state, i16 x, i16 y,
 }
 
 
-void PlatformDrawImage(PlatformState state, struct MtmcGraphic* image,
-    i16 x, i16 y) {
-    for (int i = 0; i < image->width; ++i) {
-        if ((i + x >= state->screen_width) || (i + x < 0)) { continue; }
-        for (int j = 0; j < image->height; ++j) {
-            if ((j + y >= state->screen_height) || (j + y < 0)) { continue; }
-            u8 mask = image->mask[(image->width + 7) / 8 * j + i / 8] >> (i % 8);
-            if ((mask & 1) == 1) { continue; }
-            size_t n = state->screen_height * (i + x + 1) - (j + y + 1);
-            u8 c = (image->data[(image->width + 3) / 4 * j + i / 4] >> (i % 4 * 2)) & 3;
-            state->canvas[n] = c;
+void PlatformDrawImage(PlatformState state, const struct MtmcSpriteAtlas* atlas,
+    i16 index, i16 x, i16 y) {
+    if (_PlatformEnsureWindow(state) != 0) { return; }
+    const struct MtmcSprite* sprite = &atlas->sprites[index];
+    const u8* mask = &atlas->pixels[sprite->mask_offset];
+    const u8* data = &atlas->pixels[sprite->data_offset];
+    int i0 = x < 0 ? -x : 0;
+    int j0 = y < 0 ? -y : 0;
+    int i1 = sprite->width;
+    int j1 = sprite->height;
+    if (i1 > state->screen_width - x) { i1 = state->screen_width - x; }
+    if (j1 > state->screen_height - y) { j1 = state->screen_height - y; }
+
+    for (int i = i0; i < i1; ++i) {
+        GLubyte* column = &state->canvas[state->screen_height * (i + x + 1) - (y + 1)];
+        u8 mbit = 1 << (i % 8);
+        u8 dshift = i % 4 * 2;
+        for (int j = j0; j < j1; ++j) {
+            if (sprite->mask_stride != 0 &&
+                (mask[sprite->mask_stride * j + i / 8] & mbit) != 0) { continue; }
+            column[-j] = (data[sprite->data_stride * j + i / 4] >> dshift) & 3;
         }
     }
 }
 
 
 i16 PlatformGetJoystick(PlatformState state) {
-    if (state->window == NULL) {
-        _PlatformCreateWindow(state);
+    if (_PlatformEnsureWindow(state) != 0) { return 0; }
+    _PlatformPumpEvents(state);
+    return atomic_load(&state->buttons);
+}
+
+
+/* Output goes to file, or is kept in memory when capturing.
+   Flushes happen on the policy events, when threshold is reached,
+   and on PlatformDeinit. Captured output is dropped on PlatformSetOutput. */
+void PlatformSetOutput(PlatformState state, FILE* file, int flush,
+    size_t threshold) {
+    if (state->output_capture != 0) {
+        state->output_size = 0;
+    }
+    PlatformFlushOutput(state);
+    state->output_file = file;
+    state->output_flush = flush;
+    state->output_threshold = threshold;
+    state->output_capture = 0;
+}
+
+
+void PlatformCaptureOutput(PlatformState state) {
+    PlatformFlushOutput(state);
+    state->output_capture = 1;
+}
+
+
+const char* PlatformGetOutput(PlatformState state, size_t* size) {
+    *size = state->output_size;
+    return state->output;
+}
+
+
+size_t PlatformGetOutputCount(PlatformState state) {
+    return state->output_total;
+}
+
+
+void PlatformFlushOutput(PlatformState state) {
+    if (state->output_capture != 0 || state->output_size == 0) {
+        return;
+    }
+    FILE* file = state->output_file != NULL ? state->output_file : stdout;
+    fwrite(state->output, 1, state->output_size, file);
+    fflush(file);
+    state->output_size = 0;
+}
+
+
+static int _PlatformOutputReserve(PlatformState state, size_t size) {
+    if (state->output_flush == PlatformOutputFlush_auto) {
+        FILE* file = state->output_file != NULL ? state->output_file : stdout;
+        state->output_flush = isatty(fileno(file)) != 0 ?
+            (PlatformOutputFlush_newline | PlatformOutputFlush_read) :
+            PlatformOutputFlush_read;
+    }
+    if (state->output_threshold == 0) {
+        state->output_threshold = _OutputThreshold;
+    }
+    if (state->output_capture == 0 &&
+        state->output_size + size > state->output_threshold) {
+        PlatformFlushOutput(state);
+    }
+    size_t capacity = state->output_size + size;
+    if (capacity > state->output_capacity) {
+        if (capacity < state->output_threshold) {
+            capacity = state->output_threshold;
+        }
+        if (capacity < state->output_capacity * 2) {
+            capacity = state->output_capacity * 2;
+        }
+        char* output = realloc(state->output, capacity);
+        if (output == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        state->output = output;
+        state->output_capacity = capacity;
+    }
+    return 0;
+}
+
+
+/* Compares output against the expected stream, one buffer at a time.
+   The first differing byte, or output past the end, is a mismatch. */
+void PlatformSetExpectedOutput(PlatformState state, FILE* file) {
+    state->expect_file = file;
+    state->expect_data = NULL;
+    state->expect_position = 0;
+    state->expect_size = 0;
+    state->expect_offset = 0;
+    state->expect_memory = 0;
+    state->expect_mismatch = 0;
+}
+
+
+/* Expects data, which must outlive the platform. */
+void PlatformSetExpectedOutputData(PlatformState state, const void* data,
+    size_t size) {
+    PlatformSetExpectedOutput(state, NULL);
+    state->expect_data = data;
+    state->expect_size = size;
+    state->expect_memory = 1;
+}
+
+
+static int _PlatformExpectFill(PlatformState state) {
+    if (state->expect_position < state->expect_size) { return 0; }
+    if (state->expect_memory != 0 || state->expect_file == NULL) { return 1; }
+    if (state->expect == NULL) {
+        state->expect = malloc(_InputBufferSize);
+        if (state->expect == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    size_t n = fread(state->expect, 1, _InputBufferSize, state->expect_file);
+    if (n == 0) { return 1; }
+    state->expect_data = state->expect;
+    state->expect_position = 0;
+    state->expect_size = n;
+    return 0;
+}
+
+
+static void _PlatformExpect(PlatformState state, const char* s, size_t size) {
+    while (size > 0 && state->expect_mismatch == 0) {
+        if (_PlatformExpectFill(state) != 0) {
+            state->expect_mismatch = 1;
+            break;
+        }
+        const char* p = &state->expect_data[state->expect_position];
+        size_t avail = state->expect_size - state->expect_position;
+        size_t n = size < avail ? size : avail;
+        if (memcmp(p, s, n) != 0) {
+            size_t i = 0;
+            while (p[i] == s[i]) { ++i; }
+            state->expect_offset += i;
+            state->expect_mismatch = 1;
+            break;
+        }
+        state->expect_position += n;
+        state->expect_offset += n;
+        s += n;
+        size -= n;
     }
-    _PlatformRunloop(state);
-    // _PlatformPollGamepads(state);
-    return state->buttons;
+}
+
+
+/* Returns nonzero once output has diverged from the expected stream.
+   When complete, missing trailing output is a mismatch as well. */
+int PlatformCheckOutput(PlatformState state, int complete, size_t* offset) {
+    if (state->expect_file == NULL && state->expect_memory == 0) { return 0; }
+    if (complete != 0 && state->expect_mismatch == 0 &&
+        _PlatformExpectFill(state) == 0) {
+        state->expect_mismatch = 1;
+    }
+    *offset = state->expect_offset;
+    return state->expect_mismatch;
+}
+
+
+static void _PlatformOutput(PlatformState state, const char* s, size_t size) {
+    if (state->expect_file != NULL || state->expect_memory != 0) {
+        _PlatformExpect(state, s, size);
+    }
+    if (_PlatformOutputReserve(state, size) != 0) { return; }
+    memcpy(&state->output[state->output_size], s, size);
+    state->output_size += size;
+    state->output_total += size;
+    if ((state->output_flush & PlatformOutputFlush_threshold) == 0 &&
+        (state->output_flush & PlatformOutputFlush_newline) != 0 &&
+        memchr(s, '\n', size) != NULL) {
+        PlatformFlushOutput(state);
+    }
+}
+
+
+static void _PlatformFlushBeforeRead(PlatformState state) {
+    if ((state->output_flush & PlatformOutputFlush_threshold) == 0 &&
+        (state->output_flush & PlatformOutputFlush_read) != 0) {
+        PlatformFlushOutput(state);
+    }
+}
+
+
+void PlatformSetInput(PlatformState state, FILE* file) {
+    state->input_file = file;
+    state->input_data = NULL;
+    state->input_position = 0;
+    state->input_size = 0;
+    state->input_memory = 0;
+    state->input_eof = 0;
+}
+
+
+/* Serves input from data, which must outlive the platform. */
+void PlatformSetInputData(PlatformState state, const void* data, size_t size) {
+    PlatformSetInput(state, NULL);
+    state->input_data = data;
+    state->input_size = size;
+    state->input_memory = 1;
+}
+
+
+static int _PlatformInputFill(PlatformState state) {
+    if (state->input_position < state->input_size) { return 0; }
+    if (state->input_eof != 0 || state->input_memory != 0) { return 1; }
+    if (state->input == NULL) {
+        state->input = malloc(_InputBufferSize);
+        if (state->input == NULL) {
+            perror("malloc");
+            state->input_eof = 1;
+            return 1;
+        }
+    }
+    _PlatformFlushBeforeRead(state);
+    FILE* file = state->input_file != NULL ? state->input_file : stdin;
+    ssize_t n;
+    do {
+        n = read(fileno(file), state->input, _InputBufferSize);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        state->input_eof = 1;
+        return 1;
+    }
+    state->input_data = state->input;
+    state->input_position = 0;
+    state->input_size = n;
+    return 0;
+}
+
+
+static int _PlatformInputGet(PlatformState state) {
+    if (_PlatformInputFill(state) != 0) { return -1; }
+    return (u8) state->input_data[state->input_position++];
+}
+
+
+static int _PlatformInputPeek(PlatformState state) {
+    if (_PlatformInputFill(state) != 0) { return -1; }
+    return (u8) state->input_data[state->input_position];
 }
 
 
 char PlatformGetChar(PlatformState state) {
-    char buf[4];
-    char* res = fgets(buf, sizeof(buf), stdin);
-    return (res == NULL) ? 0 : buf[0];
+    int c = _PlatformInputGet(state);
+    return (c < 0) ? 0 : c;
+}
+
+
+/* Reads a line into buf, without the newline. The rest of a line
+   longer than buf is dropped. Returns -1 at end of input. */
+i16 PlatformReadString(PlatformState state, char* buf, i16 bufsize) {
+    if (bufsize <= 0) { return 0; }
+    if (_PlatformInputFill(state) != 0) {
+        buf[0] = '\0';
+        return -1;
+    }
+    size_t size = 0;
+    while (_PlatformInputFill(state) == 0) {
+        const char* p = &state->input_data[state->input_position];
+        size_t avail = state->input_size - state->input_position;
+        const char* eol = memchr(p, '\n', avail);
+        size_t n = (eol != NULL) ? (size_t)(eol - p) : avail;
+        size_t space = bufsize - 1 - size;
+        memcpy(&buf[size], p, n < space ? n : space);
+        size += n < space ? n : space;
+        if (eol != NULL) {
+            state->input_position += n + 1;
+            break;
+        }
+        state->input_position += n;
+    }
+    buf[size] = '\0';
+    return size;
 }
 
 
 void PlatformPutChar(PlatformState state, char c) {
-    fputc(c, stdout);
+    _PlatformOutput(state, &c, 1);
 }
 
 
 void PlatformPutString(PlatformState state, const char* s) {
-    fputs(s, stdout);
+    _PlatformOutput(state, s, strlen(s));
+}
+
+
+void PlatformPutBuffer(PlatformState state, const char* s, size_t size) {
+    _PlatformOutput(state, s, size);
 }
 
 
 void PlatformPutWord(PlatformState state, i16 n) {
-    fprintf(stdout, "%d", (int) n);
+    char buf[8];
+    size_t size = _MtmcFormatWord(buf, n);
+    _PlatformOutput(state, buf, size);
 }
 
 
@@ -529,31 +1232,30 @@ i16 PlatformParseWord(PlatformState state, const char* s) {
 }
 
 
+/* Reads a whitespace-separated number, and the blanks up to
+   the end of its line. */
 i16 PlatformReadWord(PlatformState state) {
+    int c;
+    do {
+        c = _PlatformInputGet(state);
+    } while (c >= 0 && isspace(c));
+    if (c < 0) { return 0; }
+
     char buf[24];
-    char* res = fgets(buf, sizeof(buf), stdin);
-    if (res != NULL) {
-        return PlatformParseWord(state, buf);
+    size_t size = 0;
+    for (; c >= 0 && !isspace(c); c = _PlatformInputGet(state)) {
+        if (size < sizeof(buf) - 1) {
+            buf[size++] = c;
+        }
     }
-    return 0;
-}
+    buf[size] = '\0';
 
-
-void PlatformRandomSeed(PlatformState state, int seed) {
-    u64 s = ((u64)seed << 1) | 1;
-    state->randstate[0] = (s) & 0xFFFF;
-    state->randstate[1] = (s >> 16) & 0xFFFF;
-    state->randstate[2] = (s >> 32) & 0xFFFF;
-    state->randstate[3] = (s >> 48) & 0xFFFF;
-}
-
-
-i16 PlatformRandom(PlatformState state, i16 start, i16 stop) {
-    i16 m = stop - start;
-    if (m <= 0) { return start; }
-    u64 x = nrand48(&state->randstate[0]);
-    i16 res = start + ((((u64)1 << 48) - x) % m);
-    return res;
+    while (c >= 0 && c != '\n') {
+        c = _PlatformInputPeek(state);
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n') { break; }
+        state->input_position += 1;
+    }
+    return PlatformParseWord(state, buf);
 }
 
 
@@ -571,152 +1273,562 @@ i16 PlatformSetTimer(PlatformState state, i16 millis) {
 }
 
 
-static int _PlatformGetDiskPath(PlatformState state,
-    char* buf, int bufsize) {
-    char* res = realpath("./disk", buf);
-    if (res == NULL) { perror("realpath"); return 1; }
+/* The disk root is resolved and opened once, on first use. */
+static int _PlatformGetDiskPath(PlatformState state) {
+    if (state->disk_ready != 0) { return 0; }
+    state->disk_fd = open("./disk", O_RDONLY | O_DIRECTORY);
+    if (state->disk_fd < 0) { perror("open"); return 1; }
+    state->disk_ready = 1;
     return 0;
 }
 
 
-static int _PlatformTryResolvePath(PlatformState state, const char* filename,
-    char* buf, int bufsize) {
-    char disk[PATH_MAX];
-    char path[PATH_MAX];
-    char resolved[PATH_MAX];
+/* Joins cwd and filename into an absolute disk path, folding "." and
+   "..", which stop at the disk root. */
+static int _PlatformNormalizePath(const char* cwd, const char* filename,
+    char* buf, size_t bufsize) {
+    const char* parts[2] = { (*filename == '/' ? "" : cwd), filename };
+    size_t size = 0;
+    for (int k = 0; k < 2; ++k) {
+        const char* p = parts[k];
+        for (;;) {
+            while (*p == '/') { ++p; }
+            if (*p == '\0') { break; }
+            const char* end = p;
+            while (*end != '\0' && *end != '/') { ++end; }
+            size_t n = end - p;
+            if (n == 1 && p[0] == '.') {
+            }
+            else if (n == 2 && p[0] == '.' && p[1] == '.') {
+                while (size > 0 && buf[--size] != '/') {
+                }
+            }
+            else {
+                if (size + n + 2 > bufsize) { return 1; }
+                buf[size++] = '/';
+                memcpy(&buf[size], p, n);
+                size += n;
+            }
+            p = end;
+        }
+    }
+    if (size == 0) {
+        buf[size++] = '/';
+    }
+    buf[size] = '\0';
+    return 0;
+}
 
-    int res = _PlatformGetDiskPath(state, disk, sizeof(disk));
-    if (res != 0) { return res; }
 
-    if (strlen(state->cwd) == 0) {
-        strcpy(state->cwd, "/");
+/* Opens the path by walking down from the disk root, refusing symlinks
+   at every component, so the fd can only refer to a file on the disk.
+   Returns 2 for a missing path, 3 for a path leaving the disk. */
+static int _PlatformWalkPath(PlatformState state, const char* path,
+    int flags, int* result) {
+    int fd = state->disk_fd;
+    int res = 0;
+    const char* p = path;
+    for (;;) {
+        while (*p == '/') { ++p; }
+        const char* end = strchr(p, '/');
+        size_t n = (end != NULL) ? (size_t)(end - p) : strlen(p);
+        char name[NAME_MAX + 1];
+        if (n > NAME_MAX) { errno = ENAMETOOLONG; res = 2; break; }
+        memcpy(name, p, n);
+        name[n] = '\0';
+        if (n == 0) {
+            strcpy(name, ".");
+        }
+        while (end != NULL && end[1] == '\0') { end = NULL; }
+        int last = (end == NULL);
+        int next = openat(fd, name, (last ? flags : O_RDONLY | O_DIRECTORY) |
+            O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0) {
+            /* a symlink opened as a directory fails with ENOTDIR */
+            struct stat st;
+            int err = errno;
+            res = (err == ELOOP ||
+                (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISLNK(st.st_mode))) ? 3 : 2;
+            errno = err;
+            break;
+        }
+        if (fd != state->disk_fd) { close(fd); }
+        fd = next;
+        if (last) {
+            *result = fd;
+            return 0;
+        }
+        p = end;
     }
+    if (fd != state->disk_fd) { close(fd); }
+    return res;
+}
 
-    res = snprintf(path, sizeof(path), "./disk%s%s",
-        (*filename == '/' ? "" : state->cwd), filename);
-    if (res <= 0) { perror("snprintf"); return 1; }
 
-    char* pres = realpath(path, resolved);
-    if (pres == NULL) {
-        return 2;
-    }
+/* Opens a program filename on the disk, and gives its disk path. */
+static int _PlatformTryOpenPath(PlatformState state, const char* filename,
+    int flags, int* fd, char* path, size_t pathsize) {
+    int res = _PlatformGetDiskPath(state);
+    if (res != 0) { return res; }
 
-    int n = strlen(disk);
-    if (strncmp(disk, resolved, n) != 0) {
-        return 3;
+    if (strlen(state->cwd) == 0) {
+        strcpy(state->cwd, "/");
     }
 
-    strncpy(buf, resolved, bufsize);
-    buf[bufsize-1] = '\0';
-    return 0;
+    res = _PlatformNormalizePath(state->cwd, filename, path, pathsize);
+    if (res != 0) { errno = ENAMETOOLONG; return 2; }
+    return _PlatformWalkPath(state, path, flags, fd);
 }
 
 
-static int _PlatformResolvePath(PlatformState state, const char* filename,
-    char* buf, int bufsize) {
-    int res = _PlatformTryResolvePath(state, filename, buf, bufsize);
+static int _PlatformOpenPath(PlatformState state, const char* filename,
+    int flags, int* fd, char* path, size_t pathsize) {
+    int res = _PlatformTryOpenPath(state, filename, flags, fd, path, pathsize);
     switch (res) {
         case 0: return 0;
-        case 2: perror("realpath"); break;
+        case 2: perror("resolve"); break;
         case 3: fputs("not on disk\n", stderr); break;
     }
     return 1;
 }
 
 
-static int _PlatformFileReadCells(FILE* fp, u8* buf, int maxcol, int maxrow) {
+/* Packs eight cells into a byte, the first cell in the low bit. Matches
+   all eight bytes against 'O' at once, then gathers the match bits. */
+static u8 _PlatformPackCells(const char* s) {
+    u64 x;
+    memcpy(&x, s, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    x ^= 0x4F4F4F4F4F4F4F4Full;
+    x = ~(((x & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | x) &
+        0x8080808080808080ull;
+    return ((x >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+
+/* Packs a .cells pattern into maxrow rows of maxcol bits, 'O' cells set.
+   Blank and '!' lines before the first row are skipped, longer rows are
+   cut, and missing cells and rows are zero. */
+static int _PlatformParseCells(const char* data, size_t size, u8* buf,
+    int maxcol, int maxrow) {
     maxcol = (maxcol + 7) / 8;
-    int row = 0, col = 0;
-    u8* p = buf;
-    u8 value = 0;
-    u8 ix = 0;
-    int state = 0;
-    for (; row < maxrow;) {
-        int c = fgetc(fp);
-        if (c == EOF) { break; }
-        switch (state) {
-            case 0:
-                if (isspace(c) != 0) {
-                }
-                else if (c == '!') {
-                    state = 9;
-                }
-                else {
-                    value = (c == 'O') ? 1 : 0;
-                    ix = 1;
-                    state = 1;
-                }
-                break;
-            case 1:
-                if (c == '\n') {
-                    for (; col < maxcol; ++col) {
-                        *p++ = value;
-                        value = 0;
-                    }
-                    row += 1;
-                    col = 0;
-                    value = 0;
-                    ix = 0;
-                }
-                else {
-                    value |= ((c == 'O') ? 1 : 0) << ix;
-                    if (ix < 7) {
-                        ix += 1;
-                    }
-                    else {
-                        *p++ = value;
-                        col += 1;
-                        value = 0;
-                        ix = 0;
-                        if (col >= maxcol) {
-                            row += 1;
-                            col = 0;
-                            state = 8;
-                        }
-                    }
-                }
-                break;
-            case 8:
-                if (c == '\n') {
-                    state = 1;
-                }
-                break;
-            case 9:
-                if (c == '\n') {
-                    state = 0;
-                }
-                break;
+    const char* p = data;
+    const char* end = data + size;
+    while (p < end) {
+        if (isspace((unsigned char)*p) != 0) {
+            ++p;
         }
-    }
-    for (; col < maxcol; ++col) {
-        *p++ = value;
-        value = 0;
-    }
-    for (; row < maxrow; ++row) {
-        for (int i = 0; i < maxcol; ++i) {
-            *p++ = 0;
+        else if (*p == '!') {
+            const char* eol = memchr(p, '\n', end - p);
+            p = (eol != NULL) ? eol + 1 : end;
+        }
+        else {
+            break;
         }
     }
-    return 0;
-}
-
 
-i16 PlatformFileRead(PlatformState state, const char* filename,
+    u8* out = buf;
+    int row = 0;
+    for (; row < maxrow && p < end; ++row) {
+        const char* eol = memchr(p, '\n', end - p);
+        size_t n = ((eol != NULL) ? eol : end) - p;
+        if (n > (size_t)maxcol * 8) {
+            n = (size_t)maxcol * 8;
+        }
+        size_t k = 0;
+        for (; k + 8 <= n; k += 8) {
+            *out++ = _PlatformPackCells(&p[k]);
+        }
+        if (k < n) {
+            u8 value = 0;
+            for (size_t i = 0; k + i < n; ++i) {
+                value |= ((p[k + i] == 'O') ? 1 : 0) << i;
+            }
+            *out++ = value;
+            k += 8;
+        }
+        memset(out, 0, maxcol - k / 8);
+        out += maxcol - k / 8;
+        p = (eol != NULL) ? eol + 1 : end;
+    }
+    memset(out, 0, (size_t)(maxrow - row) * maxcol);
+    return 0;
+}
+
+
+/* Maps the whole file for the parser. */
+static int _PlatformFileReadCells(FILE* fp, u8* buf, int maxcol, int maxrow) {
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        return 1;
+    }
+    if (st.st_size == 0) {
+        return _PlatformParseCells(NULL, 0, buf, maxcol, maxrow);
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    int res = _PlatformParseCells(data, st.st_size, buf, maxcol, maxrow);
+    munmap(data, st.st_size);
+    return res;
+}
+
+
+static u32 _PlatformDiskHash(const char* path) {
+    u32 h = 0x811C9DC5;
+    for (; *path != '\0'; ++path) {
+        h = (h ^ (u8)*path) * 0x01000193;
+    }
+    return h;
+}
+
+
+static const struct PlatformDiskEntry* _PlatformDiskEntries(PlatformState state) {
+    const struct PlatformDiskHeader* header = (const void*) state->disk_image;
+    return (const void*) &state->disk_image[sizeof(*header) +
+        header->buckets * sizeof(u32)];
+}
+
+
+static int _PlatformDiskValidate(const u8* image, size_t size) {
+    const struct PlatformDiskHeader* header = (const void*) image;
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, _PlatformDiskMagic, sizeof(header->magic)) != 0) {
+        return 1;
+    }
+    u64 buckets = header->buckets;
+    u64 count = header->count;
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0 || count >= buckets ||
+        sizeof(*header) + buckets * sizeof(u32) +
+        count * sizeof(struct PlatformDiskEntry) > size) {
+        return 1;
+    }
+    /* lookups probe until an empty bucket, there must be one */
+    const u32* table = (const void*) &image[sizeof(*header)];
+    u64 empty = 0;
+    for (u64 i = 0; i < buckets; ++i) {
+        if (table[i] > count) { return 1; }
+        empty += table[i] == 0;
+    }
+    if (empty == 0) { return 1; }
+    const struct PlatformDiskEntry* entries = (const void*) &table[buckets];
+    for (u64 i = 0; i < count; ++i) {
+        const struct PlatformDiskEntry* entry = &entries[i];
+        if (entry->path >= size || entry->name < entry->path ||
+            memchr(&image[entry->path], '\0', size - entry->path) == NULL ||
+            entry->name - entry->path > strlen((const char*) &image[entry->path])) {
+            return 1;
+        }
+        u64 end = (u64)entry->offset + entry->size;
+        if (end > ((entry->flags & 1) != 0 ? count : size)) { return 1; }
+    }
+    return 0;
+}
+
+
+/* Maps the image built by PlatformWriteDiskImage, NULL unmaps. */
+int PlatformSetDiskImage(PlatformState state, const char* filename) {
+    if (state->disk_image != NULL) {
+        munmap((void*) state->disk_image, state->disk_image_size);
+        state->disk_image = NULL;
+        state->disk_image_size = 0;
+    }
+    if (filename == NULL) { return 0; }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { perror("open"); fprintf(stderr, "file: '%s'\n", filename); return 1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror("fstat"); close(fd); return 1; }
+    size_t size = st.st_size;
+    void* image = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (image == MAP_FAILED || _PlatformDiskValidate(image, size) != 0) {
+        if (image != MAP_FAILED) { munmap(image, size); }
+        fprintf(stderr, "not a disk image: '%s'\n", filename);
+        return 1;
+    }
+    state->disk_image = image;
+    state->disk_image_size = size;
+    state->dir_path[0] = '\0';
+    return 0;
+}
+
+
+static const struct PlatformDiskEntry* _PlatformDiskLookup(PlatformState state,
+    const char* name) {
+    char path[PATH_MAX];
+    if (strlen(state->cwd) == 0) {
+        strcpy(state->cwd, "/");
+    }
+    if (_PlatformNormalizePath(state->cwd, name, path, sizeof(path)) != 0) {
+        return NULL;
+    }
+    const struct PlatformDiskHeader* header = (const void*) state->disk_image;
+    const u32* table = (const void*) &state->disk_image[sizeof(*header)];
+    const struct PlatformDiskEntry* entries = _PlatformDiskEntries(state);
+    u32 mask = header->buckets - 1;
+    for (u32 h = _PlatformDiskHash(path) & mask; table[h] != 0; h = (h + 1) & mask) {
+        const struct PlatformDiskEntry* entry = &entries[table[h] - 1];
+        if (strcmp((const char*) &state->disk_image[entry->path], path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+static i16 _PlatformCopyName(char* buf, size_t bufsize, const char* name,
+    size_t size) {
+    if (bufsize == 0) { return 0; }
+    int res = size;
+    if (res + 1 <= (int)bufsize) {
+        memcpy(buf, name, res + 1);
+    }
+    else {
+        res = bufsize - 1;
+        memcpy(buf, name, res);
+        buf[res] = '\0';
+    }
+    return res;
+}
+
+
+struct PlatformDiskBuilder {
+    const char* root;
+    size_t count;
+    size_t capacity;
+    struct PlatformDiskEntry* entries;
+    size_t names_size;
+    size_t names_capacity;
+    char* names;
+};
+
+
+static int _PlatformDiskAdd(struct PlatformDiskBuilder* builder,
+    const char* path, size_t name, u32 flags, u64 size) {
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity > 0 ? builder->capacity * 2 : 64;
+        void* entries = realloc(builder->entries, capacity * sizeof(*builder->entries));
+        if (entries == NULL) { perror("realloc"); return 1; }
+        builder->entries = entries;
+        builder->capacity = capacity;
+    }
+    size_t n = strlen(path) + 1;
+    if (builder->names_size + n > builder->names_capacity) {
+        size_t capacity = builder->names_capacity > 0 ? builder->names_capacity * 2 : 4096;
+        while (capacity < builder->names_size + n) { capacity *= 2; }
+        char* names = realloc(builder->names, capacity);
+        if (names == NULL) { perror("realloc"); return 1; }
+        builder->names = names;
+        builder->names_capacity = capacity;
+    }
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "file too large: %s\n", path);
+        return 1;
+    }
+    builder->entries[builder->count++] = (struct PlatformDiskEntry) {
+        .path = builder->names_size,
+        .name = builder->names_size + name,
+        .flags = flags,
+        .size = size,
+    };
+    memcpy(&builder->names[builder->names_size], path, n);
+    builder->names_size += n;
+    return 0;
+}
+
+
+static int _PlatformDiskAddChildren(struct PlatformDiskBuilder* builder,
+    size_t index) {
+    char host[PATH_MAX];
+    char path[PATH_MAX];
+    const char* dir = &builder->names[builder->entries[index].path];
+    snprintf(host, sizeof(host), "%s%s", builder->root, dir);
+    struct dirent** list;
+    int n = scandir(host, &list, NULL, alphasort);
+    if (n < 0) { perror("scandir"); fprintf(stderr, "path: %s\n", host); return 1; }
+
+    size_t first = builder->count;
+    int res = 0;
+    for (int i = 0; i < n; ++i) {
+        const char* sname = list[i]->d_name;
+        struct stat st;
+        if (res != 0 ||
+            strcmp(".", sname) == 0 ||
+            strcmp("..", sname) == 0) {
+            free(list[i]);
+            continue;
+        }
+        dir = &builder->names[builder->entries[index].path];
+        snprintf(path, sizeof(path), "%s/%s", (strcmp(dir, "/") == 0 ? "" : dir), sname);
+        snprintf(host, sizeof(host), "%s%s", builder->root, path);
+        /* symlinks stay out, as they do on ./disk */
+        if (lstat(host, &st) != 0) {
+            perror("lstat");
+            fprintf(stderr, "path: %s\n", host);
+            res = 1;
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            res = _PlatformDiskAdd(builder, path, strlen(path) - strlen(sname), 1, 0);
+        }
+        else if (S_ISREG(st.st_mode)) {
+            res = _PlatformDiskAdd(builder, path, strlen(path) - strlen(sname), 0, st.st_size);
+        }
+        free(list[i]);
+    }
+    free(list);
+    builder->entries[index].offset = first;
+    builder->entries[index].size = builder->count - first;
+    return res;
+}
+
+
+static int _PlatformDiskCopyFile(const char* host, size_t size, FILE* output) {
+    char buf[16 * 1024];
+    FILE* fp = fopen(host, "rb");
+    if (fp == NULL) { perror("fopen"); fprintf(stderr, "path: %s\n", host); return 1; }
+    while (size > 0) {
+        size_t n = fread(buf, 1, size < sizeof(buf) ? size : sizeof(buf), fp);
+        if (n == 0) {
+            /* the file shrank since it was listed */
+            n = size < sizeof(buf) ? size : sizeof(buf);
+            memset(buf, 0, n);
+        }
+        fwrite(buf, 1, n, output);
+        size -= n;
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/* Packs the directory tree at root into a disk image. */
+int PlatformWriteDiskImage(const char* root, FILE* output) {
+    struct PlatformDiskBuilder builder = { .root = root };
+    int res = _PlatformDiskAdd(&builder, "/", 1, 1, 0);
+    for (size_t i = 0; res == 0 && i < builder.count; ++i) {
+        if ((builder.entries[i].flags & 1) != 0) {
+            res = _PlatformDiskAddChildren(&builder, i);
+        }
+    }
+
+    u32 buckets = 1;
+    while (res == 0 && buckets <= builder.count * 2) { buckets *= 2; }
+    u32* table = res == 0 ? calloc(buckets, sizeof(u32)) : NULL;
+    if (res == 0 && table == NULL) { perror("calloc"); res = 1; }
+
+    size_t names = sizeof(struct PlatformDiskHeader) + buckets * sizeof(u32) +
+        builder.count * sizeof(struct PlatformDiskEntry);
+    u64 data = names + builder.names_size;
+    for (size_t i = 0; res == 0 && i < builder.count; ++i) {
+        struct PlatformDiskEntry* entry = &builder.entries[i];
+        u32 h = _PlatformDiskHash(&builder.names[entry->path]) & (buckets - 1);
+        while (table[h] != 0) { h = (h + 1) & (buckets - 1); }
+        table[h] = i + 1;
+        entry->path += names;
+        entry->name += names;
+        if ((entry->flags & 1) == 0) {
+            entry->offset = data;
+            data += entry->size;
+        }
+    }
+    if (res == 0 && data > UINT32_MAX) {
+        fputs("disk image too large\n", stderr);
+        res = 1;
+    }
+
+    if (res == 0) {
+        struct PlatformDiskHeader header = {
+            .count = builder.count,
+            .buckets = buckets,
+        };
+        memcpy(header.magic, _PlatformDiskMagic, sizeof(header.magic));
+        fwrite(&header, sizeof(header), 1, output);
+        fwrite(table, sizeof(u32), buckets, output);
+        fwrite(builder.entries, sizeof(struct PlatformDiskEntry), builder.count, output);
+        fwrite(builder.names, 1, builder.names_size, output);
+    }
+    for (size_t i = 0; res == 0 && i < builder.count; ++i) {
+        const struct PlatformDiskEntry* entry = &builder.entries[i];
+        if ((entry->flags & 1) != 0) { continue; }
+        char host[PATH_MAX];
+        snprintf(host, sizeof(host), "%s%s", root,
+            &builder.names[entry->path - names]);
+        res = _PlatformDiskCopyFile(host, entry->size, output);
+    }
+    if (res == 0 && (fflush(output) != 0 || ferror(output) != 0)) {
+        perror("fwrite");
+        res = 1;
+    }
+
+    free(table);
+    free(builder.entries);
+    free(builder.names);
+    return res;
+}
+
+
+static i16 _PlatformMemoryFileRead(const char* path, const u8* data,
+    size_t size, u8* buf, i16 bufsize, i16 maxlines) {
+    size_t n = strlen(path);
+    if (n >= 6 && strcmp(&path[n - 6], ".cells") == 0) {
+        int res = _PlatformParseCells((const char*) data, size,
+            buf, bufsize, maxlines);
+        if (res != 0) { return -1; }
+    }
+    else {
+        n = size < (size_t)bufsize ? size : (size_t)bufsize;
+        if (n == 0) { return -1; }
+        memcpy(buf, data, n);
+    }
+    return 0;
+}
+
+
+static i16 _PlatformDiskFileRead(PlatformState state, const char* filename,
     u8* buf, i16 bufsize, i16 maxlines) {
+    const struct PlatformDiskEntry* entry = _PlatformDiskLookup(state, filename);
+    if (entry == NULL || (entry->flags & 1) != 0) {
+        fputs("not on disk\n", stderr);
+        fprintf(stderr, "%s\n", filename);
+        return 1;
+    }
+    return _PlatformMemoryFileRead(
+        (const char*) &state->disk_image[entry->path],
+        &state->disk_image[entry->offset], entry->size,
+        buf, bufsize, maxlines);
+}
+
+
+static i16 _PlatformBaseFileRead(PlatformState state, const char* filename,
+    u8* buf, i16 bufsize, i16 maxlines) {
+    if (state->disk_image != NULL) {
+        return _PlatformDiskFileRead(state, filename, buf, bufsize, maxlines);
+    }
     char path[PATH_MAX];
-    int res = _PlatformResolvePath(state, filename, path, sizeof(path));
+    int fd;
+    int res = _PlatformOpenPath(state, filename, O_RDONLY, &fd,
+        path, sizeof(path));
     if (res != 0) {
         fprintf(stderr, "%s\n", filename);
         return 1;
     }
-    FILE* fp = fopen(path, "rb");
+    FILE* fp = fdopen(fd, "rb");
     if (fp == NULL) {
-        perror("fopen");
+        perror("fdopen");
         fprintf(stderr, "%s\n", filename);
+        close(fd);
         return 1;
     }
     int n = strlen(path);
-    if (strcmp(&path[n - 6], ".cells") == 0) {
+    if (n >= 6 && strcmp(&path[n - 6], ".cells") == 0) {
         int res = _PlatformFileReadCells(fp, buf, bufsize, maxlines);
         if (res != 0) { fclose(fp); return -1; }
     }
@@ -730,8 +1842,9 @@ i16 PlatformFileRead(PlatformState state, const char* filename,
 
 
 i16 PlatformGetCurrentDir(PlatformState state, char* buf, size_t bufsize) {
-    char path[PATH_MAX];
-    _PlatformResolvePath(state, "/", path, sizeof(path));
+    if (strlen(state->cwd) == 0) {
+        strcpy(state->cwd, "/");
+    }
     int res = strlen(state->cwd);
     if (res + 1 <= (int)bufsize) {
         strcpy(buf, state->cwd);
@@ -746,89 +1859,521 @@ i16 PlatformGetCurrentDir(PlatformState state, char* buf, size_t bufsize) {
 
 
 i16 PlatformSetCurrentDir(PlatformState state, const char* name) {
-    char disk[PATH_MAX];
+    if (state->disk_image != NULL) {
+        const struct PlatformDiskEntry* entry = _PlatformDiskLookup(state, name);
+        if (entry == NULL || (entry->flags & 1) == 0) { return 1; }
+        strcpy(state->cwd, (const char*) &state->disk_image[entry->path]);
+        state->dir_path[0] = '\0';
+        return 0;
+    }
     char path[PATH_MAX];
-    int res = _PlatformResolvePath(state, name, path, sizeof(path));
-    if (res != 0) { return res; }
-    res = _PlatformGetDiskPath(state, disk, sizeof(disk));
+    int fd;
+    int res = _PlatformOpenPath(state, name, O_RDONLY | O_DIRECTORY, &fd,
+        path, sizeof(path));
     if (res != 0) { return res; }
-    int n = strlen(disk);
-    strcpy(state->cwd, &path[n]);
-    if (strlen(state->cwd) == 0) {
-        strcpy(state->cwd, "/");
+    close(fd);
+    strcpy(state->cwd, path);
+    state->dir_path[0] = '\0';
+    return 0;
+}
+
+
+static struct timespec _PlatformStatMtime(const struct stat* st) {
+#if defined(__APPLE__)
+    return st->st_mtimespec;
+#else
+    return st->st_mtim;
+#endif
+}
+
+
+static int _PlatformNameCompare(const void* a, const void* b) {
+    return strcoll(*(const char* const*) a, *(const char* const*) b);
+}
+
+
+/* Lists the open directory once, and again only when it changes.
+   A listing taken within a second of the change may miss a later
+   change with the same coarse mtime, and is not trusted. */
+static int _PlatformDirLoad(PlatformState state, const char* path, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("stat");
+        fprintf(stderr, "path: %s\n", path);
+        return 1;
+    }
+    struct timespec mtime = _PlatformStatMtime(&st);
+    dev_t dev = st.st_dev;
+    ino_t ino = st.st_ino;
+    if (state->dir_racy == 0 &&
+        strcmp(state->dir_path, path) == 0 &&
+        state->dir_dev == dev &&
+        state->dir_ino == ino &&
+        state->dir_mtime.tv_sec == mtime.tv_sec &&
+        state->dir_mtime.tv_nsec == mtime.tv_nsec) {
+        return 0;
+    }
+    state->dir_path[0] = '\0';
+
+    int dfd = dup(fd);
+    DIR* dir = (dfd >= 0) ? fdopendir(dfd) : NULL;
+    if (dir == NULL) {
+        perror("opendir");
+        fprintf(stderr, "path: %s\n", path);
+        if (dfd >= 0) { close(dfd); }
+        return 1;
+    }
+    char* raw = NULL;
+    size_t names = 0, capacity = 0, count = 0;
+    int res = 0;
+    for (struct dirent* de; (de = readdir(dir)) != NULL;) {
+        const char* sname = de->d_name;
+        if (strcmp(".", sname) == 0 ||
+            strcmp("..", sname) == 0) {
+            continue;
+        }
+        size_t n = strlen(sname) + 1;
+        if (names + n > capacity) {
+            capacity = (names + n) * 2;
+            char* buf = realloc(raw, capacity);
+            if (buf == NULL) { res = 1; break; }
+            raw = buf;
+        }
+        memcpy(&raw[names], sname, n);
+        names += n;
+        count += 1;
+    }
+    closedir(dir);
+
+    size_t slots = count > 0 ? count : 1;
+    const char** sorted = NULL;
+    struct PlatformDirEntry* entries = NULL;
+    char* buf = NULL;
+    if (res == 0) {
+        sorted = malloc(slots * sizeof(const char*));
+    }
+    if (sorted != NULL) {
+        entries = realloc(state->dir_entries,
+            slots * sizeof(struct PlatformDirEntry));
     }
+    if (entries != NULL) {
+        state->dir_entries = entries;
+        buf = realloc(state->dir_names, names > 0 ? names : 1);
+    }
+    if (buf != NULL) { state->dir_names = buf; }
+    if (buf == NULL) {
+        perror("realloc");
+        free(sorted);
+        free(raw);
+        return 1;
+    }
+
+    const char* p = raw;
+    for (size_t i = 0; i < count; ++i) {
+        sorted[i] = p;
+        p += strlen(p) + 1;
+    }
+    qsort(sorted, count, sizeof(const char*), _PlatformNameCompare);
+
+    names = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const char* sname = sorted[i];
+        struct PlatformDirEntry* entry = &entries[i];
+        entry->name = names;
+        entry->size = strlen(sname);
+        entry->flags = 0;
+        memcpy(&buf[names], sname, entry->size + 1);
+        names += entry->size + 1;
+        if (fstatat(fd, sname, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            entry->flags |= S_ISDIR(st.st_mode) == 0 ? 0 : 1;
+        }
+        else {
+            perror("stat");
+            fprintf(stderr, "path: %s/%s\n", path, sname);
+        }
+    }
+    free(sorted);
+    free(raw);
+
+    strcpy(state->dir_path, path);
+    ++state->dir_loads;
+    state->dir_dev = dev;
+    state->dir_ino = ino;
+    state->dir_mtime = mtime;
+    state->dir_racy = time(NULL) <= mtime.tv_sec + 1;
+    state->dir_count = count;
     return 0;
 }
 
 
-i16 PlatformDirGetSize(PlatformState state, const char* name) {
+static i16 _PlatformBaseDirGetSize(PlatformState state, const char* name) {
+    if (state->disk_image != NULL) {
+        const struct PlatformDiskEntry* entry = _PlatformDiskLookup(state, name);
+        if (entry == NULL || (entry->flags & 1) == 0) { return -1; }
+        return entry->size;
+    }
     char path[PATH_MAX];
-    int res = _PlatformTryResolvePath(state, name, path, sizeof(path));
+    int fd;
+    int res = _PlatformTryOpenPath(state, name, O_RDONLY | O_DIRECTORY, &fd,
+        path, sizeof(path));
     if (res != 0) { return -1; }
-    struct dirent** entries;
-    int n = scandir(path, &entries, NULL, alphasort);
-    if (n < 0) { perror("scandir"); return -1; }
-    res = n;
-    for (int i = 0; i < n; ++i) {
-        if (strcmp(".", entries[i]->d_name) == 0 ||
-            strcmp("..", entries[i]->d_name) == 0) {
-            res -= 1;
-        }
-    }
-    free(entries);
-    return res;
+    res = _PlatformDirLoad(state, path, fd);
+    close(fd);
+    if (res != 0) { return -1; }
+    return state->dir_count;
 }
 
 
-i16 PlatformDirReadEntry(PlatformState state, const char* name,
+static i16 _PlatformBaseDirReadEntry(PlatformState state, const char* name,
     i16 index, i16* flags, char* buf, size_t bufsize) {
+    if (state->disk_image != NULL) {
+        const struct PlatformDiskEntry* dir = _PlatformDiskLookup(state, name);
+        if (dir == NULL || (dir->flags & 1) == 0) { return -1; }
+        if ((size_t)index >= dir->size) { return -1; }
+        const struct PlatformDiskEntry* entry =
+            &_PlatformDiskEntries(state)[dir->offset + index];
+        const char* sname = (const char*) &state->disk_image[entry->name];
+        *flags = entry->flags & 1;
+        return _PlatformCopyName(buf, bufsize, sname, strlen(sname));
+    }
+
     char path[PATH_MAX];
-    int res = _PlatformResolvePath(state, name, path, sizeof(path));
+    int fd;
+    int res = _PlatformOpenPath(state, name, O_RDONLY | O_DIRECTORY, &fd,
+        path, sizeof(path));
+    if (res != 0) { return -1; }
+    res = _PlatformDirLoad(state, path, fd);
+    close(fd);
     if (res != 0) { return -1; }
-    if (index++ < 0) { return -1; }
+    if ((size_t)index >= state->dir_count) { return -1; }
 
-    struct dirent** entries;
-    int n = scandir(path, &entries, NULL, alphasort);
-    if (n < 0) {
-        perror("scandir");
-        fprintf(stderr, "path: %s\n", path);
+    const struct PlatformDirEntry* entry = &state->dir_entries[index];
+    *flags = entry->flags;
+    return _PlatformCopyName(buf, bufsize,
+        &state->dir_names[entry->name], entry->size);
+}
+
+
+/* Disk path of a program filename, relative to the current directory. */
+static int _PlatformAbsolutePath(PlatformState state, const char* filename,
+    char* buf, size_t bufsize) {
+    if (strlen(state->cwd) == 0) {
+        strcpy(state->cwd, "/");
+    }
+    return _PlatformNormalizePath(state->cwd, filename, buf, bufsize);
+}
+
+
+/* Type of the path below the overlay: -1 missing, 0 file, 1 directory. */
+static int _PlatformBaseFileType(PlatformState state, const char* path) {
+    if (state->disk_image != NULL) {
+        const struct PlatformDiskEntry* entry = _PlatformDiskLookup(state, path);
+        if (entry == NULL) { return -1; }
+        return entry->flags & 1;
+    }
+    char host[PATH_MAX];
+    int fd;
+    if (_PlatformTryOpenPath(state, path, O_RDONLY | O_NONBLOCK, &fd,
+        host, sizeof(host)) != 0) {
         return -1;
     }
+    struct stat st;
+    int res = fstat(fd, &st);
+    close(fd);
+    if (res != 0) { return -1; }
+    return S_ISDIR(st.st_mode) ? 1 : 0;
+}
 
-    const char* sname = NULL;
-    for (int i = 0; i < n && index > 0; ++i) {
-        sname = entries[i]->d_name;
-        if (strcmp(".", sname) == 0 ||
-            strcmp("..", sname) == 0) {
-            continue;
+
+static struct PlatformOverlayFile* _PlatformOverlayFind(PlatformState state,
+    const char* path) {
+    for (size_t i = 0; i < state->overlay_count; ++i) {
+        struct PlatformOverlayFile* file = &state->overlay[i];
+        if (strcmp((const char*) &state->overlay_arena[file->path], path) == 0) {
+            return file;
         }
-        index -= 1;
     }
-    if (index != 0) { free(entries); return -1; }
+    return NULL;
+}
 
-    strcat(path, "/");
-    strcat(path, sname);
 
-    *flags = 0;
-    struct stat st;
-    res = stat(path, &st);
-    if (res == 0) {
-        *flags |= S_ISDIR(st.st_mode) == 0 ? 0 : 1;
+static int _PlatformOverlayAlloc(PlatformState state, size_t size,
+    size_t* offset) {
+    size_t need = state->overlay_arena_size + size;
+    if (need > state->overlay_arena_capacity) {
+        size_t capacity = state->overlay_arena_capacity;
+        if (capacity == 0) { capacity = _OverlayArenaSize; }
+        while (capacity < need) { capacity *= 2; }
+        u8* arena = realloc(state->overlay_arena, capacity);
+        if (arena == NULL) { perror("realloc"); return 1; }
+        state->overlay_arena = arena;
+        state->overlay_arena_capacity = capacity;
     }
-    else {
-        perror("stat");
-        fprintf(stderr, "path: %s\n", path);
+    *offset = state->overlay_arena_size;
+    state->overlay_arena_size = need;
+    return 0;
+}
+
+
+static struct PlatformOverlayFile* _PlatformOverlayAdd(PlatformState state,
+    const char* path) {
+    if (state->overlay_count == state->overlay_capacity) {
+        size_t capacity = state->overlay_capacity != 0 ?
+            state->overlay_capacity * 2 : _OverlayFilesSize;
+        struct PlatformOverlayFile* files = realloc(state->overlay,
+            capacity * sizeof(struct PlatformOverlayFile));
+        if (files == NULL) { perror("realloc"); return NULL; }
+        state->overlay = files;
+        state->overlay_capacity = capacity;
     }
+    size_t n = strlen(path) + 1;
+    size_t offset;
+    if (_PlatformOverlayAlloc(state, n, &offset) != 0) { return NULL; }
+    memcpy(&state->overlay_arena[offset], path, n);
+    struct PlatformOverlayFile* file = &state->overlay[state->overlay_count++];
+    *file = (struct PlatformOverlayFile) { .path = offset };
+    return file;
+}
 
-    res = strlen(sname);
-    if (res + 1 <= (int)bufsize) {
-        strcpy(buf, sname);
+
+/* Writes go to memory only, reusing the file's arena space when the new
+   contents fit. The parent directory must exist on the disk. */
+i16 PlatformFileWrite(PlatformState state, const char* filename,
+    const u8* buf, i16 size) {
+    char path[PATH_MAX];
+    if (size < 0 ||
+        _PlatformAbsolutePath(state, filename, path, sizeof(path)) != 0) {
+        return 1;
     }
-    else {
-        res = bufsize - 1;
-        strncpy(buf, sname, res + 1);
-        buf[res + 1] = '\0';
+    struct PlatformOverlayFile* file = _PlatformOverlayFind(state, path);
+    if (file == NULL) {
+        char parent[PATH_MAX];
+        strcpy(parent, path);
+        char* name = strrchr(parent, '/');
+        name[name == parent ? 1 : 0] = '\0';
+        if (strcmp(path, "/") == 0 ||
+            _PlatformBaseFileType(state, path) == 1 ||
+            _PlatformBaseFileType(state, parent) != 1) {
+            fputs("cannot write\n", stderr);
+            fprintf(stderr, "%s\n", filename);
+            return 1;
+        }
+        file = _PlatformOverlayAdd(state, path);
+        if (file == NULL) { return 1; }
     }
-    free(entries);
-    return res;
+    if ((size_t)size > file->capacity) {
+        size_t offset;
+        if (_PlatformOverlayAlloc(state, size, &offset) != 0) { return 1; }
+        file->data = offset;
+        file->capacity = size;
+    }
+    memcpy(&state->overlay_arena[file->data], buf, size);
+    file->size = size;
+    file->deleted = 0;
+    ++state->overlay_version;
+    return 0;
+}
+
+
+i16 PlatformFileDelete(PlatformState state, const char* filename) {
+    char path[PATH_MAX];
+    if (_PlatformAbsolutePath(state, filename, path, sizeof(path)) != 0) {
+        return 1;
+    }
+    struct PlatformOverlayFile* file = _PlatformOverlayFind(state, path);
+    if (file != NULL ? file->deleted != 0 :
+        _PlatformBaseFileType(state, path) != 0) {
+        fputs("not on disk\n", stderr);
+        fprintf(stderr, "%s\n", filename);
+        return 1;
+    }
+    if (file == NULL) {
+        file = _PlatformOverlayAdd(state, path);
+        if (file == NULL) { return 1; }
+    }
+    file->size = 0;
+    file->deleted = 1;
+    ++state->overlay_version;
+    return 0;
+}
+
+
+i16 PlatformFileRead(PlatformState state, const char* filename,
+    u8* buf, i16 bufsize, i16 maxlines) {
+    char path[PATH_MAX];
+    const struct PlatformOverlayFile* file = NULL;
+    if (state->overlay_count != 0 &&
+        _PlatformAbsolutePath(state, filename, path, sizeof(path)) == 0) {
+        file = _PlatformOverlayFind(state, path);
+    }
+    if (file == NULL) {
+        return _PlatformBaseFileRead(state, filename, buf, bufsize, maxlines);
+    }
+    if (file->deleted != 0) {
+        fputs("not on disk\n", stderr);
+        fprintf(stderr, "%s\n", filename);
+        return 1;
+    }
+    return _PlatformMemoryFileRead(path, &state->overlay_arena[file->data],
+        file->size, buf, bufsize, maxlines);
+}
+
+
+static int _PlatformOverlayInDir(const char* dir, const char* path) {
+    size_t n = strrchr(path, '/') - path;
+    if (n == 0) { return strcmp(dir, "/") == 0; }
+    return strlen(dir) == n && memcmp(dir, path, n) == 0;
+}
+
+
+static int _PlatformOverlayDirAdd(PlatformState state, size_t* names,
+    const char* name, size_t size, i16 flags) {
+    size_t need = *names + size + 1;
+    if (need > state->overlay_dir_names_capacity) {
+        size_t capacity = need * 2;
+        char* buf = realloc(state->overlay_dir_names, capacity);
+        if (buf == NULL) { perror("realloc"); return 1; }
+        state->overlay_dir_names = buf;
+        state->overlay_dir_names_capacity = capacity;
+    }
+    struct PlatformDirEntry* entry =
+        &state->overlay_dir_entries[state->overlay_dir_count++];
+    entry->name = *names;
+    entry->size = size;
+    entry->flags = flags;
+    memcpy(&state->overlay_dir_names[*names], name, size + 1);
+    *names = need;
+    return 0;
+}
+
+
+/* Merges the base listing with the overlay files of the directory, in
+   the same collation order, unless the overlay leaves it unchanged.
+   Returns 1 for a merged listing, 0 to use the base, -1 on error. */
+static int _PlatformOverlayDirLoad(PlatformState state, const char* name) {
+    char path[PATH_MAX];
+    if (state->overlay_count == 0 ||
+        _PlatformAbsolutePath(state, name, path, sizeof(path)) != 0) {
+        return 0;
+    }
+    size_t changed = 0;
+    for (size_t i = 0; i < state->overlay_count; ++i) {
+        const char* fpath = (const char*) &state->overlay_arena[state->overlay[i].path];
+        changed += _PlatformOverlayInDir(path, fpath);
+    }
+    if (changed == 0) { return 0; }
+
+    i16 n = _PlatformBaseDirGetSize(state, path);
+    if (n < 0) { return -1; }
+    if (strcmp(state->overlay_dir, path) == 0 &&
+        state->overlay_dir_version == state->overlay_version &&
+        state->overlay_dir_loads == state->dir_loads) {
+        return 1;
+    }
+
+    state->overlay_dir[0] = '\0';
+    state->overlay_dir_count = 0;
+    struct PlatformDirEntry* entries = realloc(state->overlay_dir_entries,
+        (n + changed) * sizeof(struct PlatformDirEntry));
+    const char** added = malloc(changed * sizeof(const char*));
+    if (entries != NULL) { state->overlay_dir_entries = entries; }
+    if (entries == NULL || added == NULL) {
+        perror("realloc");
+        free(added);
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < state->overlay_count; ++i) {
+        const struct PlatformOverlayFile* file = &state->overlay[i];
+        const char* fpath = (const char*) &state->overlay_arena[file->path];
+        if (file->deleted == 0 && _PlatformOverlayInDir(path, fpath)) {
+            added[count++] = strrchr(fpath, '/') + 1;
+        }
+    }
+    qsort(added, count, sizeof(const char*), _PlatformNameCompare);
+
+    int res = 0;
+    size_t names = 0;
+    size_t k = 0;
+    for (i16 i = 0; i < n && res == 0; ++i) {
+        char sname[NAME_MAX + 1];
+        i16 flags = 0;
+        int size = _PlatformBaseDirReadEntry(state, path, i, &flags,
+            sname, sizeof(sname));
+        if (size < 0) { res = 1; break; }
+        if (flags == 0) {
+            char fpath[PATH_MAX];
+            int m = snprintf(fpath, sizeof(fpath), "%s/%s",
+                (strcmp(path, "/") == 0 ? "" : path), sname);
+            if (m > 0 && m < (int)sizeof(fpath) &&
+                _PlatformOverlayFind(state, fpath) != NULL) {
+                continue;
+            }
+        }
+        while (k < count && res == 0 && strcoll(added[k], sname) < 0) {
+            res = _PlatformOverlayDirAdd(state, &names, added[k],
+                strlen(added[k]), 0);
+            ++k;
+        }
+        if (res == 0) {
+            res = _PlatformOverlayDirAdd(state, &names, sname, size, flags);
+        }
+    }
+    for (; k < count && res == 0; ++k) {
+        res = _PlatformOverlayDirAdd(state, &names, added[k],
+            strlen(added[k]), 0);
+    }
+    free(added);
+    if (res != 0) { return -1; }
+
+    strcpy(state->overlay_dir, path);
+    state->overlay_dir_version = state->overlay_version;
+    state->overlay_dir_loads = state->dir_loads;
+    return 1;
+}
+
+
+i16 PlatformDirGetSize(PlatformState state, const char* name) {
+    int res = _PlatformOverlayDirLoad(state, name);
+    if (res == 0) { return _PlatformBaseDirGetSize(state, name); }
+    if (res < 0) { return -1; }
+    return state->overlay_dir_count;
+}
+
+
+i16 PlatformDirReadEntry(PlatformState state, const char* name,
+    i16 index, i16* flags, char* buf, size_t bufsize) {
+    if (index < 0) { return -1; }
+    int res = _PlatformOverlayDirLoad(state, name);
+    if (res == 0) {
+        return _PlatformBaseDirReadEntry(state, name, index, flags,
+            buf, bufsize);
+    }
+    if (res < 0 || (size_t)index >= state->overlay_dir_count) { return -1; }
+    const struct PlatformDirEntry* entry = &state->overlay_dir_entries[index];
+    *flags = entry->flags;
+    return _PlatformCopyName(buf, bufsize,
+        &state->overlay_dir_names[entry->name], entry->size);
+}
+
+
+/* Dumps the overlay in order of first change: "+ PATH SIZE", a newline,
+   the data and a newline for written files, "- PATH" for deleted ones. */
+int PlatformDumpOverlay(PlatformState state, FILE* output) {
+    for (size_t i = 0; i < state->overlay_count; ++i) {
+        const struct PlatformOverlayFile* file = &state->overlay[i];
+        const char* path = (const char*) &state->overlay_arena[file->path];
+        if (file->deleted != 0) {
+            fprintf(output, "- %s\n", path);
+            continue;
+        }
+        fprintf(output, "+ %s %zu\n", path, file->size);
+        fwrite(&state->overlay_arena[file->data], 1, file->size, output);
+        fputc('\n', output);
+    }
+    if (fflush(output) != 0) {
+        perror("fflush");
+        return 1;
+    }
+    return 0;
 }
@@ -3,6 +3,9 @@
 #endif
 #include <assert.h>
 
+#include <png.h>
+#define PAIV_JSON_IMPLEMENTATION
+#include "paiv_json.h"
 #define PAIV_MTMC_IMPLEMENTATION
 #include "paiv_mtmc16.h"
 #define PAIV_MTMCASM_IMPLEMENTATION
@@ -10,18 +13,6 @@
 #include "platform.c"
 
 
-int MtmcExecutableLoad(FILE* file, struct MtmcExecutable* exe) {
-    FatalError();
-    return 1;
-}
-
-
-int MtmcAssemblerLinkExecutable(struct MtmcExeObject* exe, FILE* output) {
-    FatalError();
-    return 1;
-}
-
-
 static struct Platform _platform = {};
 
 
@@ -40,10 +31,10 @@ static void _TestLoadProgramAt(struct MtmcEmu* emu, const char* program, i16 off
     struct MtmcExecutable exe = (struct MtmcExecutable) {
         .format = obj.format,
         .codesize = obj.codesize,
+        .code = obj.code,
         .datasize = obj.datasize,
+        .data = obj.data,
     };
-    memcpy(exe.code, obj.code, obj.codesize);
-    memcpy(exe.data, obj.data, obj.datasize);
 
     PlatformInit(&_platform);
     emu->platform = &_platform;
@@ -72,6 +63,1024 @@ static void testSysCall(void) {
     assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
 }
 
+static void _TestSysCallAnswer(struct MtmcEmu* emu, i16 number) {
+    MtmcSetRegisterValue(emu, RV, 42);
+}
+
+static void testSysCallTable(void) {
+    struct MtosSysCallTable table;
+    MtosSysCallTableInit(&table);
+    MtosSysCallRegister(&table, MtosSysCall_rnd, _TestSysCallAnswer,
+        MtosSysCallFlag_pure);
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys rnd");
+    emu.syscalls = &table;
+    MtmcRun(&emu);
+    assert(MtmcGetRegisterValue(&emu, RV) == 42);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+}
+
+static void testWriteIntCapture(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wint");
+    PlatformCaptureOutput(&_platform);
+    MtmcSetRegisterValue(&emu, A0, -32768);
+    MtmcRun(&emu);
+    size_t size = 0;
+    const char* output = PlatformGetOutput(&_platform, &size);
+    assert(size == 6);
+    assert(memcmp(output, "-32768", size) == 0);
+    PlatformSetOutput(&_platform, NULL, PlatformOutputFlush_auto, 0);
+}
+
+static void testPrintFormat(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys printf");
+    PlatformCaptureOutput(&_platform);
+    strcpy((char*)&emu.memory[0x100], "x=%d c=%c s=%s %q%");
+    strcpy((char*)&emu.memory[0x200], "hi");
+    MtmcWriteWordToMemory(&emu, 0x300, -5);
+    MtmcWriteWordToMemory(&emu, 0x302, 'Z');
+    MtmcWriteWordToMemory(&emu, 0x304, 0x200);
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcSetRegisterValue(&emu, A1, 0x300);
+    MtmcRun(&emu);
+    size_t size = 0;
+    const char* output = PlatformGetOutput(&_platform, &size);
+    const char expected[] = "x=-5 c=Z s=hi %q%";
+    assert(size == sizeof(expected) - 1);
+    assert(memcmp(output, expected, size) == 0);
+    assert(MtmcGetRegisterValue(&emu, RV) == (i16)size);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+    PlatformSetOutput(&_platform, NULL, PlatformOutputFlush_auto, 0);
+}
+
+static void testOutputFlushThreshold(void) {
+    FILE* file = tmpfile();
+    assert(file != NULL);
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wstr\nsys rchr");
+    PlatformSetOutput(&_platform, file, PlatformOutputFlush_newline, 0);
+    PlatformSetInputData(&_platform, "z", 1);
+    strcpy((char*)&emu.memory[0x100], "ab\n");
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcRun(&emu);
+    assert(ftell(file) == 3);
+
+    /* the other events are ignored below the threshold */
+    emu = (struct MtmcEmu) {0};
+    _TestLoadProgram(&emu, "sys wstr\nsys rchr\nsys wstr");
+    PlatformSetOutput(&_platform, file, PlatformOutputFlush_threshold |
+        PlatformOutputFlush_newline | PlatformOutputFlush_read, 8);
+    PlatformSetInputData(&_platform, "z", 1);
+    strcpy((char*)&emu.memory[0x100], "ab\n");
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcRun(&emu);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+    assert(ftell(file) == 3);
+    emu = (struct MtmcEmu) {0};
+    _TestLoadProgram(&emu, "sys wstr");
+    strcpy((char*)&emu.memory[0x100], "cdefgh");
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcRun(&emu);
+    assert(ftell(file) == 9);
+    PlatformFlushOutput(&_platform);
+    assert(ftell(file) == 15);
+    PlatformSetOutput(&_platform, NULL, PlatformOutputFlush_auto, 0);
+    PlatformSetInput(&_platform, NULL);
+    fclose(file);
+}
+
+static void testReadString(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys rstr");
+    static const char input[] = "hello world\nnext";
+    PlatformSetInputData(&_platform, input, sizeof(input) - 1);
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcSetRegisterValue(&emu, A1, 6);
+    MtmcRun(&emu);
+    assert(MtmcGetRegisterValue(&emu, RV) == 5);
+    assert(strcmp((char*)&emu.memory[0x100], "hello") == 0);
+    char buf[8];
+    assert(PlatformReadString(&_platform, buf, sizeof(buf)) == 4);
+    assert(strcmp(buf, "next") == 0);
+    assert(PlatformReadString(&_platform, buf, sizeof(buf)) == -1);
+    PlatformSetInput(&_platform, NULL);
+}
+
+static void testReadIntAndChar(void) {
+    static const char input[] = " 12 -7  \nx32768\n";
+    PlatformSetInputData(&_platform, input, sizeof(input) - 1);
+    assert(PlatformReadWord(&_platform) == 12);
+    assert(PlatformReadWord(&_platform) == -7);
+    assert(PlatformGetChar(&_platform) == 'x');
+    assert(PlatformReadWord(&_platform) == 0);
+    assert(PlatformGetChar(&_platform) == 0);
+    PlatformSetInput(&_platform, NULL);
+}
+
+static void testMemCopy(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "mcp t0 t1 4");
+    memcpy(&emu.memory[0x100], "abcdef", 6);
+    MtmcSetRegisterValue(&emu, T0, 0x100);
+    MtmcSetRegisterValue(&emu, T1, 0x102);
+    MtmcRun(&emu);
+    assert(memcmp(&emu.memory[0x100], "ababcd", 6) == 0);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+}
+
+static void testMemCopySysCallOverlap(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys memcopy");
+    memcpy(&emu.memory[0x100], "abcdef", 6);
+    MtmcSetRegisterValue(&emu, A0, 0x102);
+    MtmcSetRegisterValue(&emu, A1, 0x100);
+    MtmcSetRegisterValue(&emu, A2, 4);
+    MtmcRun(&emu);
+    assert(memcmp(&emu.memory[0x100], "cdefef", 6) == 0);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+}
+
+static void testMemCopyOutOfRange(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys memcopy");
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcSetRegisterValue(&emu, A1, Mtmc_MEMORY_SIZE - 2);
+    MtmcSetRegisterValue(&emu, A2, 4);
+    MtmcRun(&emu);
+    assert(emu.memory[Mtmc_MEMORY_SIZE - 2] == 0);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_PERMANENT_ERROR);
+}
+
+static void testFileNameOutOfRange(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wfile");
+    MtmcSetRegisterValue(&emu, A0, -1);
+    MtmcSetRegisterValue(&emu, A1, 0x200);
+    MtmcSetRegisterValue(&emu, A2, 1);
+    MtmcRun(&emu);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_PERMANENT_ERROR);
+
+    struct MtmcEmu other = {0};
+    _TestLoadProgram(&other, "sys dfile");
+    memset(&other.memory[Mtmc_MEMORY_SIZE - 4], 'a', 4);
+    MtmcSetRegisterValue(&other, A0, Mtmc_MEMORY_SIZE - 4);
+    MtmcRun(&other);
+    assert(MtmcGetStatus(&other) == MtmcEmuStatus_PERMANENT_ERROR);
+}
+
+static void testInstructionBudget(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "j 0");
+    emu.budget.instructions = 1000;
+    MtmcRun(&emu);
+    assert(emu.usage.instructions == 1000);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_INSTRUCTION_LIMIT);
+}
+
+static void testSysCallBudget(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys rnd\nj 2");
+    emu.budget.syscalls = 1;
+    MtmcRun(&emu);
+    assert(emu.usage.syscalls == 1);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_SYSCALL_LIMIT);
+}
+
+static void testExpectedOutput(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wint\nsys wint");
+    PlatformCaptureOutput(&_platform);
+    static const char expect[] = "4242";
+    PlatformSetExpectedOutputData(&_platform, expect, sizeof(expect) - 1);
+    MtmcSetRegisterValue(&emu, A0, 42);
+    MtmcRun(&emu);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+    PlatformSetExpectedOutput(&_platform, NULL);
+    PlatformSetOutput(&_platform, NULL, PlatformOutputFlush_auto, 0);
+}
+
+static void testExpectedOutputMismatch(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wint\nsys wint\nsys wint");
+    PlatformCaptureOutput(&_platform);
+    static const char expect[] = "4243";
+    PlatformSetExpectedOutputData(&_platform, expect, sizeof(expect) - 1);
+    MtmcSetRegisterValue(&emu, A0, 42);
+    MtmcRun(&emu);
+    size_t offset = 0;
+    assert(PlatformCheckOutput(&_platform, 0, &offset) != 0);
+    assert(offset == 3);
+    size_t size = 0;
+    PlatformGetOutput(&_platform, &size);
+    assert(size == 4);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_OUTPUT_MISMATCH);
+    PlatformSetExpectedOutput(&_platform, NULL);
+    PlatformSetOutput(&_platform, NULL, PlatformOutputFlush_auto, 0);
+}
+
+static void testExpectedOutputMissing(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wint");
+    PlatformCaptureOutput(&_platform);
+    static const char expect[] = "42\n";
+    PlatformSetExpectedOutputData(&_platform, expect, sizeof(expect) - 1);
+    MtmcSetRegisterValue(&emu, A0, 42);
+    MtmcRun(&emu);
+    size_t offset = 0;
+    assert(PlatformCheckOutput(&_platform, 1, &offset) != 0);
+    assert(offset == 2);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_OUTPUT_MISMATCH);
+    PlatformSetExpectedOutput(&_platform, NULL);
+    PlatformSetOutput(&_platform, NULL, PlatformOutputFlush_auto, 0);
+}
+
+static void testVirtualClock(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu,
+        "sys timer\nseti a0 15\nsys sleep\nseti a0 0\nsys timer");
+    emu.virtual_clock = 1;
+    MtmcSetRegisterValue(&emu, A0, 100);
+    MtmcRun(&emu);
+    assert(MtmcGetRegisterValue(&emu, RV) == 85);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+}
+
+static void testBusyWaitTimer(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu,
+        "sys timer\nseti a0 0\nloop:\nsys timer\nneqi rv 0\njnz loop");
+    MtmcSetRegisterValue(&emu, A0, 30);
+    MtmcRun(&emu);
+    assert(emu.usage.instructions < 100);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+}
+
+static void testBusyWaitVirtualTimer(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu,
+        "sys timer\nseti a0 0\nloop:\nsys timer\nneqi rv 0\njnz loop");
+    emu.virtual_clock = 1;
+    MtmcSetRegisterValue(&emu, A0, 1000);
+    MtmcRun(&emu);
+    assert(emu.usage.instructions < 20);
+    assert(emu.clock + emu.clock_skew >= Mtmc_DEFAULT_SPEED);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+}
+
+static void testBusyWaitWithWork(void) {
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu,
+        "sys timer\nseti a0 0\nloop:\nsys timer\ninc t0\nneqi rv 0\njnz loop");
+    emu.virtual_clock = 1;
+    MtmcSetRegisterValue(&emu, A0, 10);
+    MtmcRun(&emu);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+    /* every iteration ran, the clock was not moved to the deadline */
+    assert(emu.clock_skew == 0);
+    assert(MtmcGetRegisterValue(&emu, T0) > 2000);
+}
+
+static void testRandomRange(void) {
+    struct MtmcRandom random;
+    MtmcRandomSeed(&random, 42);
+    int seen[7] = {0};
+    for (int i = 0; i < 10000; ++i) {
+        i16 x = MtmcRandomRange(&random, -3, 3);
+        assert(x >= -3 && x <= 3);
+        seen[x + 3] += 1;
+    }
+    for (int i = 0; i < 7; ++i) {
+        assert(seen[i] > 0);
+    }
+    assert(MtmcRandomRange(&random, 5, 5) == 5);
+    MtmcRandomRange(&random, -32768, 32767);
+}
+
+static void testRandomSeed(void) {
+    struct MtmcEmu a = {0};
+    struct MtmcEmu b = {0};
+    _TestLoadProgram(&a, "sys rnd");
+    _TestLoadProgram(&b, "sys rnd");
+    MtmcRandomSeed(&a.random, 7);
+    MtmcRandomSeed(&b.random, 7);
+    MtmcSetRegisterValue(&a, A0, 100);
+    MtmcSetRegisterValue(&a, A1, 1);
+    MtmcSetRegisterValue(&b, A0, 100);
+    MtmcSetRegisterValue(&b, A1, 1);
+    MtmcRun(&a);
+    MtmcRun(&b);
+    i16 x = MtmcGetRegisterValue(&a, RV);
+    assert(x >= 1 && x <= 100);
+    assert(x == MtmcGetRegisterValue(&b, RV));
+}
+
+static void testRecordReplay(void) {
+    FILE* log = tmpfile();
+    assert(log != NULL);
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys rstr\nsys rchr");
+    static const char input[] = "hello\nz";
+    PlatformSetInputData(&_platform, input, sizeof(input) - 1);
+    assert(MtmcSetRecord(&emu, log) == 0);
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcSetRegisterValue(&emu, A1, 16);
+    MtmcRun(&emu);
+    assert(MtmcGetRegisterValue(&emu, RV) == 'z');
+
+    rewind(log);
+    PlatformSetInputData(&_platform, "", 0);
+    struct MtmcEmu replay = {0};
+    _TestLoadProgram(&replay, "sys rstr\nsys rchr");
+    assert(MtmcSetReplay(&replay, log) == 0);
+    MtmcSetRegisterValue(&replay, A0, 0x100);
+    MtmcSetRegisterValue(&replay, A1, 16);
+    MtmcRun(&replay);
+    assert(strcmp((char*)&replay.memory[0x100], "hello") == 0);
+    assert(MtmcGetRegisterValue(&replay, RV) == 'z');
+    assert(MtmcGetStatus(&replay) == MtmcEmuStatus_FINISHED);
+    PlatformSetInput(&_platform, NULL);
+    fclose(log);
+}
+
+static void testReplayDiverged(void) {
+    FILE* log = tmpfile();
+    assert(log != NULL);
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys rnd");
+    assert(MtmcSetRecord(&emu, log) == 0);
+    MtmcRun(&emu);
+
+    rewind(log);
+    struct MtmcEmu replay = {0};
+    _TestLoadProgram(&replay, "sys rchr");
+    assert(MtmcSetReplay(&replay, log) == 0);
+    MtmcRun(&replay);
+    assert(MtmcGetStatus(&replay) == MtmcEmuStatus_PERMANENT_ERROR);
+    fclose(log);
+}
+
+static void _TestTouch(const char* path) {
+    FILE* fp = fopen(path, "w");
+    assert(fp != NULL);
+    fclose(fp);
+}
+
+static void _TestRemoveTree(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) { return; }
+    if (!S_ISDIR(st.st_mode)) {
+        assert(remove(path) == 0);
+        return;
+    }
+    DIR* dir = opendir(path);
+    assert(dir != NULL);
+    char child[PATH_MAX];
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        _TestRemoveTree(child);
+    }
+    closedir(dir);
+    assert(rmdir(path) == 0);
+}
+
+struct _TestDisk {
+    char cwd[PATH_MAX];
+    char root[sizeof("/tmp/testmtmc16.XXXXXX")];
+};
+
+/* Enters a fresh temporary directory holding an empty disk/,
+   with the platform back to its defaults. */
+static void _TestDiskSetUp(struct _TestDisk* disk) {
+    assert(getcwd(disk->cwd, sizeof(disk->cwd)) != NULL);
+    strcpy(disk->root, "/tmp/testmtmc16.XXXXXX");
+    assert(mkdtemp(disk->root) != NULL);
+    assert(chdir(disk->root) == 0);
+    PlatformDeinit(&_platform);
+    _platform = (struct Platform) {0};
+    assert(mkdir("disk", 0755) == 0);
+}
+
+static void _TestDiskTearDown(struct _TestDisk* disk) {
+    PlatformDeinit(&_platform);
+    _platform = (struct Platform) {0};
+    assert(chdir(disk->cwd) == 0);
+    _TestRemoveTree(disk->root);
+}
+
+static void testDirentListing(void) {
+    struct _TestDisk disk;
+    _TestDiskSetUp(&disk);
+    assert(mkdir("disk/c", 0755) == 0);
+    _TestTouch("disk/b");
+    _TestTouch("disk/a");
+
+    assert(PlatformDirGetSize(&_platform, "/") == 3);
+    char buf[8];
+    i16 flags = -1;
+    assert(PlatformDirReadEntry(&_platform, "/", 0, &flags, buf, sizeof(buf)) == 1);
+    assert(strcmp(buf, "a") == 0 && flags == 0);
+    assert(PlatformDirReadEntry(&_platform, "/", 2, &flags, buf, sizeof(buf)) == 1);
+    assert(strcmp(buf, "c") == 0 && flags == 1);
+    assert(PlatformDirReadEntry(&_platform, "/", 3, &flags, buf, sizeof(buf)) == -1);
+
+    /* the platform can be used again after PlatformDeinit, with an old
+       enough listing to be cached */
+    const struct timespec old[2] = { { .tv_sec = 1 }, { .tv_sec = 1 } };
+    assert(utimensat(AT_FDCWD, "disk", old, 0) == 0);
+    assert(PlatformDirGetSize(&_platform, "/") == 3);
+    PlatformDeinit(&_platform);
+    assert(PlatformDirReadEntry(&_platform, "/", 0, &flags, buf, sizeof(buf)) == 1);
+    assert(strcmp(buf, "a") == 0 && flags == 0);
+
+    _TestTouch("disk/abcdefghij");
+    assert(PlatformDirGetSize(&_platform, "/") == 4);
+    assert(PlatformDirReadEntry(&_platform, "/", 1, &flags, buf, sizeof(buf)) == 7);
+    assert(strcmp(buf, "abcdefg") == 0);
+
+    assert(symlink("/tmp", "disk/link") == 0);
+    assert(PlatformDirGetSize(&_platform, "/link") == -1);
+    assert(PlatformDirGetSize(&_platform, "c/../../..") == 5);
+    assert(PlatformSetCurrentDir(&_platform, "./c/") == 0);
+    assert(PlatformGetCurrentDir(&_platform, buf, sizeof(buf)) == 2);
+    assert(strcmp(buf, "/c") == 0);
+    assert(PlatformDirGetSize(&_platform, "..") == 5);
+    assert(PlatformSetCurrentDir(&_platform, "/") == 0);
+
+    _TestDiskTearDown(&disk);
+}
+
+static void testDiskImage(void) {
+    struct _TestDisk disk;
+    _TestDiskSetUp(&disk);
+    assert(mkdir("disk/c", 0755) == 0);
+    FILE* fp = fopen("disk/c/d", "w");
+    assert(fp != NULL);
+    fputs("hello", fp);
+    fclose(fp);
+    _TestTouch("disk/b");
+    assert(symlink("/tmp", "disk/link") == 0);
+
+    const char* path = "disk.img";
+    fp = fopen(path, "wb");
+    assert(fp != NULL);
+    assert(PlatformWriteDiskImage("disk", fp) == 0);
+    fclose(fp);
+    assert(PlatformSetDiskImage(&_platform, path) == 0);
+
+    assert(PlatformDirGetSize(&_platform, "/") == 2);
+    assert(PlatformDirGetSize(&_platform, "/link") == -1);
+    char buf[8];
+    i16 flags = -1;
+    assert(PlatformDirReadEntry(&_platform, "/", 0, &flags, buf, sizeof(buf)) == 1);
+    assert(strcmp(buf, "b") == 0 && flags == 0);
+    assert(PlatformDirReadEntry(&_platform, "/", 1, &flags, buf, sizeof(buf)) == 1);
+    assert(strcmp(buf, "c") == 0 && flags == 1);
+    assert(PlatformDirReadEntry(&_platform, "/", 2, &flags, buf, sizeof(buf)) == -1);
+
+    assert(PlatformSetCurrentDir(&_platform, "b") == 1);
+    assert(PlatformSetCurrentDir(&_platform, "c") == 0);
+    assert(PlatformDirGetSize(&_platform, ".") == 1);
+    u8 data[8] = {0};
+    assert(PlatformFileRead(&_platform, "d", data, sizeof(data), 0) == 0);
+    assert(memcmp(data, "hello", 5) == 0);
+    assert(PlatformFileRead(&_platform, "/b", data, sizeof(data), 0) == -1);
+    assert(PlatformSetCurrentDir(&_platform, "/") == 0);
+    PlatformSetDiskImage(&_platform, NULL);
+
+    /* a table without an empty bucket would make lookups probe forever */
+    fp = fopen(path, "r+b");
+    assert(fp != NULL);
+    struct PlatformDiskHeader header;
+    assert(fread(&header, sizeof(header), 1, fp) == 1);
+    assert(fseek(fp, sizeof(header), SEEK_SET) == 0);
+    for (u32 i = 0; i < header.buckets; ++i) {
+        u32 index = 1;
+        assert(fwrite(&index, sizeof(index), 1, fp) == 1);
+    }
+    fclose(fp);
+    assert(PlatformSetDiskImage(&_platform, path) == 1);
+
+    _TestDiskTearDown(&disk);
+}
+
+static void testDiskOverlay(void) {
+    struct _TestDisk disk;
+    _TestDiskSetUp(&disk);
+    assert(mkdir("disk/c", 0755) == 0);
+    _TestTouch("disk/b");
+    _TestTouch("disk/d");
+
+    const u8 data[] = "hello";
+    assert(PlatformFileWrite(&_platform, "a", data, 5) == 0);
+    assert(PlatformFileWrite(&_platform, "/b", data, 3) == 0);
+    assert(PlatformFileDelete(&_platform, "d") == 0);
+    assert(PlatformFileDelete(&_platform, "d") == 1);
+    assert(PlatformFileDelete(&_platform, "c") == 1);
+    assert(PlatformFileWrite(&_platform, "c", data, 5) == 1);
+    assert(PlatformFileWrite(&_platform, "x/a", data, 5) == 1);
+    assert(PlatformFileWrite(&_platform, "c/e", data, 5) == 0);
+
+    u8 buf[8] = {0};
+    assert(PlatformFileRead(&_platform, "a", buf, sizeof(buf), 0) == 0);
+    assert(memcmp(buf, "hello", 5) == 0);
+    assert(PlatformFileRead(&_platform, "d", buf, sizeof(buf), 0) == 1);
+    FILE* fp = fopen("disk/b", "rb");
+    assert(fp != NULL && fgetc(fp) == EOF);
+    fclose(fp);
+    assert(access("disk/a", F_OK) != 0);
+    assert(access("disk/d", F_OK) == 0);
+
+    char name[8];
+    i16 flags = -1;
+    assert(PlatformDirGetSize(&_platform, "/") == 3);
+    assert(PlatformDirReadEntry(&_platform, "/", 0, &flags, name, sizeof(name)) == 1);
+    assert(strcmp(name, "a") == 0 && flags == 0);
+    assert(PlatformDirReadEntry(&_platform, "/", 1, &flags, name, sizeof(name)) == 1);
+    assert(strcmp(name, "b") == 0 && flags == 0);
+    assert(PlatformDirReadEntry(&_platform, "/", 2, &flags, name, sizeof(name)) == 1);
+    assert(strcmp(name, "c") == 0 && flags == 1);
+    assert(PlatformDirReadEntry(&_platform, "/", 3, &flags, name, sizeof(name)) == -1);
+    assert(PlatformDirGetSize(&_platform, "c") == 1);
+
+    assert(PlatformFileWrite(&_platform, "d", data, 2) == 0);
+    assert(PlatformDirGetSize(&_platform, "/") == 4);
+
+    char* dump = NULL;
+    size_t size = 0;
+    fp = open_memstream(&dump, &size);
+    assert(fp != NULL);
+    assert(PlatformDumpOverlay(&_platform, fp) == 0);
+    fclose(fp);
+    assert(strcmp(dump, "+ /a 5\nhello\n+ /b 3\nhel\n+ /d 2\nhe\n+ /c/e 5\nhello\n") == 0);
+    free(dump);
+
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys wfile");
+    strcpy((char*)&emu.memory[0x100], "f");
+    strcpy((char*)&emu.memory[0x200], "xyz");
+    MtmcSetRegisterValue(&emu, A0, 0x100);
+    MtmcSetRegisterValue(&emu, A1, 0x200);
+    MtmcSetRegisterValue(&emu, A2, 3);
+    MtmcRun(&emu);
+    assert(MtmcGetRegisterValue(&emu, RV) == 0);
+    assert(PlatformDirGetSize(&_platform, "/") == 5);
+    assert(access("disk/f", F_OK) != 0);
+
+    PlatformDeinit(&_platform);
+    _platform = (struct Platform) {0};
+    assert(PlatformDirGetSize(&_platform, "/") == 3);
+
+    _TestDiskTearDown(&disk);
+}
+
+static void testDiskSymlinkSwap(void) {
+    struct _TestDisk disk;
+    _TestDiskSetUp(&disk);
+    assert(mkdir("disk/c", 0755) == 0);
+    assert(mkdir("outside", 0755) == 0);
+    _TestTouch("outside/x");
+    _TestTouch("outside/y");
+    FILE* fp = fopen("disk/a", "w");
+    assert(fp != NULL);
+    fputs("public", fp);
+    fclose(fp);
+    fp = fopen("secret", "w");
+    assert(fp != NULL);
+    fputs("secret", fp);
+    fclose(fp);
+
+    u8 buf[8] = {0};
+    assert(PlatformFileRead(&_platform, "a", buf, sizeof(buf), 0) == 0);
+    assert(memcmp(buf, "public", 6) == 0);
+    assert(PlatformDirGetSize(&_platform, "/c") == 0);
+
+    assert(remove("disk/a") == 0);
+    assert(symlink("../secret", "disk/a") == 0);
+    memset(buf, 0, sizeof(buf));
+    assert(PlatformFileRead(&_platform, "a", buf, sizeof(buf), 0) == 1);
+    assert(buf[0] == 0);
+
+    assert(rmdir("disk/c") == 0);
+    assert(symlink("../outside", "disk/c") == 0);
+    assert(PlatformDirGetSize(&_platform, "/c") == -1);
+    assert(PlatformSetCurrentDir(&_platform, "/c") != 0);
+    assert(PlatformFileRead(&_platform, "/c/x", buf, sizeof(buf), 0) == 1);
+
+    _TestDiskTearDown(&disk);
+}
+
+/* Reads the array both from memory, scanning digit runs in words,
+   and from a plain file, one character at a time. */
+static JsonError _TestReadIntArray(const char* text, JsonIntType type,
+    void* buf, size_t bufsize, size_t* count) {
+    JSON json;
+    JsonStream stream;
+    assert(json_reader_init_memory(&json, &stream, text, strlen(text)) == JsonError_ok);
+    JsonError err = json_reader_read_int_array(&json, type, buf, bufsize, count);
+    json_reader_close(&json);
+
+    size_t n = 0;
+    int64_t other[4] = {0};
+    FILE* fp = fmemopen((void*) text, strlen(text), "r");
+    assert(fp != NULL);
+    assert(json_reader_init(&json, fp) == JsonError_ok);
+    assert(json_reader_read_int_array(&json, type, other, 4, &n) == err);
+    assert(n == *count);
+    if (type == JsonIntType_i64) {
+        assert(memcmp(buf, other, n * sizeof(int64_t)) == 0);
+    }
+    json_reader_close(&json);
+    fclose(fp);
+    return err;
+}
+
+static void testJsonIntArray(void) {
+    int64_t buf[4] = {0};
+    size_t count = 0;
+    assert(_TestReadIntArray("[123456789012345678, -123456789012345678]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_ok);
+    assert(count == 2);
+    assert(buf[0] == 123456789012345678ll && buf[1] == -123456789012345678ll);
+
+    assert(_TestReadIntArray("[1234567890123456789, -1234567890123456789]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_ok);
+    assert(count == 2);
+    assert(buf[0] == 1234567890123456789ll && buf[1] == -1234567890123456789ll);
+
+    assert(_TestReadIntArray("[9223372036854775807, -9223372036854775808]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_ok);
+    assert(count == 2);
+    assert(buf[0] == INT64_MAX && buf[1] == INT64_MIN);
+
+    assert(_TestReadIntArray("[1, 9223372036854775808]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_invalid);
+    assert(count == 1);
+    assert(_TestReadIntArray("[-9223372036854775809]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_invalid);
+    assert(_TestReadIntArray("[9999999999999999999]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_invalid);
+    assert(_TestReadIntArray("[12345678901234567890]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_invalid);
+    assert(_TestReadIntArray("[-12345678901234567890]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_invalid);
+    assert(_TestReadIntArray("[0, -0]",
+        JsonIntType_i64, buf, 4, &count) == JsonError_ok);
+    assert(count == 2 && buf[0] == 0 && buf[1] == 0);
+
+    i8 small[4] = {0};
+    assert(_TestReadIntArray("[-128, 127]",
+        JsonIntType_i8, small, 4, &count) == JsonError_ok);
+    assert(count == 2 && small[0] == -128 && small[1] == 127);
+    assert(_TestReadIntArray("[128]",
+        JsonIntType_i8, small, 4, &count) == JsonError_invalid);
+}
+
+/* A 9-byte buffer refills one byte at a time past the first fill,
+   so every token below lands on a refill boundary for some padding;
+   a 64-byte one reads the whole text ahead and must give the tail back. */
+static void testJsonStreamRefill(void) {
+    const char* array = "[true,false,null,\"A\\u0042C\\u0044\"]";
+    char text[64];
+    u8 buf[64];
+    for (int k = 0; k < 20; ++k) {
+        size_t buf_size = k < 10 ? 9 : sizeof(buf);
+        int pad = k % 10;
+        int size = snprintf(text, sizeof(text), "%*s%s tail", pad, "", array);
+        FILE* fp = fmemopen(text, size, "r");
+        assert(fp != NULL);
+        JSON json, arr;
+        JsonStream stream;
+        JsonValueType type;
+        assert(json_reader_init_buffered(&json, &stream, fp, buf_size, buf) == JsonError_ok);
+        assert(json_reader_open_array(&json, &arr) == JsonError_ok);
+
+        int value = -1;
+        assert(json_reader_read_array(&arr, &type) == JsonError_ok);
+        assert(type == JsonValueType_true);
+        assert(json_reader_read_bool(&arr, &value) == JsonError_ok && value == 1);
+        assert(json_reader_read_array(&arr, &type) == JsonError_ok);
+        assert(type == JsonValueType_false);
+        assert(json_reader_read_bool(&arr, &value) == JsonError_ok && value == 0);
+        assert(json_reader_read_array(&arr, &type) == JsonError_ok);
+        assert(type == JsonValueType_null);
+        assert(json_reader_read_null(&arr) == JsonError_ok);
+
+        /* one char at a time, so each escape is unread and decoded again */
+        assert(json_reader_read_array(&arr, &type) == JsonError_ok);
+        assert(type == JsonValueType_string);
+        char str[8] = {0};
+        size_t len = 0;
+        char chunk[2];
+        size_t n = sizeof(chunk);
+        JsonError err = json_reader_read_string(&arr, &n, chunk);
+        while (err == JsonError_bufsize) {
+            memcpy(&str[len], chunk, n);
+            len += n;
+            n = sizeof(chunk);
+            err = json_reader_resume_string(&arr, &n, chunk);
+        }
+        assert(err == JsonError_ok);
+        memcpy(&str[len], chunk, n);
+        assert(strcmp(str, "ABCD") == 0);
+
+        assert(json_reader_read_array(&arr, &type) == JsonError_not_found);
+
+        /* the unparsed tail goes back to the file */
+        assert(json_reader_close(&json) == JsonError_ok);
+        assert(ftell(fp) == pad + (long) strlen(array));
+        assert(fgetc(fp) == ' ');
+        fclose(fp);
+    }
+}
+
+static void _TestLinkExecutable(struct MtmcExeObject* obj, size_t buf_size,
+    char** out, size_t* size) {
+    FILE* fp = open_memstream(out, size);
+    assert(fp != NULL);
+    if (buf_size == 0) {
+        assert(MtmcAssemblerLinkExecutable(obj, fp) == 0);
+    }
+    else {
+        JSON json;
+        JsonStream stream;
+        u8 buf[buf_size];
+        assert(json_writer_init_buffered(&json, &stream, fp, buf_size, buf) == JsonError_ok);
+        assert(_MtmcAssemblerLinkJson(&json, obj) == 0);
+        assert(json_writer_close(&json) == JsonError_ok);
+    }
+    fclose(fp);
+}
+
+static void testLinkExecutableRoundTrip(void) {
+    char program[] =
+        ".data\n"
+        "msg: \"hello, world\"\n"
+        "nums: .int 1 -2 300 -32768 32767\n"
+        ".text\n"
+        "main:\n"
+        "li a0 msg\n"
+        "sys wstr\n"
+        "li t0 -1234\n"
+        "inc t0\n"
+        "sys exit\n";
+    struct MtmcExeObject obj = {
+        .format = MtmcExecutableFormat_default,
+    };
+    FILE* source = fmemopen(program, strlen(program), "rb");
+    assert(source != NULL);
+    assert(MtmcAssemblerCompileSource(source, &obj, NULL) == 0);
+    fclose(source);
+
+    /* default buffered writer, then tiny buffers that flush mid-token,
+       all byte for byte what the unbuffered writer produces */
+    char* expected = NULL;
+    size_t expected_size = 0;
+    FILE* fp = open_memstream(&expected, &expected_size);
+    assert(fp != NULL);
+    JSON json;
+    assert(json_writer_init(&json, fp) == JsonError_ok);
+    assert(_MtmcAssemblerLinkJson(&json, &obj) == 0);
+    fclose(fp);
+
+    size_t sizes[] = {0, 1, 7, 64};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        char* text = NULL;
+        size_t size = 0;
+        _TestLinkExecutable(&obj, sizes[i], &text, &size);
+        assert(size == expected_size);
+        assert(memcmp(text, expected, size) == 0);
+        free(text);
+    }
+
+    struct MtmcExecutable exe = {0};
+    fp = fmemopen(expected, expected_size, "r");
+    assert(fp != NULL);
+    assert(MtmcExecutableLoad(fp, &exe) == 0);
+    fclose(fp);
+    assert(exe.format == obj.format);
+    assert(exe.codesize == obj.codesize);
+    assert(memcmp(exe.code, obj.code, obj.codesize) == 0);
+    assert(exe.datasize == obj.datasize);
+    assert(memcmp(exe.data, obj.data, obj.datasize) == 0);
+    MtmcExecutableDeinit(&exe);
+    free(expected);
+}
+
+static void testReplayFileWrite(void) {
+    struct _TestDisk disk;
+    _TestDiskSetUp(&disk);
+    assert(mkdir("disk/c", 0755) == 0);
+    _TestTouch("disk/d");
+
+    FILE* log = tmpfile();
+    assert(log != NULL);
+    const char* program =
+        "li a0 256\nsys chdir\n"
+        "li a0 272\nli a1 512\nli a2 3\nsys wfile\n"
+        "li a0 288\nsys dfile\nmov t0 rv\n";
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, program);
+    strcpy((char*)&emu.memory[0x100], "c");
+    strcpy((char*)&emu.memory[0x110], "f");
+    strcpy((char*)&emu.memory[0x120], "/d");
+    strcpy((char*)&emu.memory[0x200], "xyz");
+    assert(MtmcSetRecord(&emu, log) == 0);
+    MtmcRun(&emu);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+    assert(MtmcGetRegisterValue(&emu, T0) == 0);
+
+    /* replay applies the changes again, not only their results */
+    rewind(log);
+    PlatformDeinit(&_platform);
+    _platform = (struct Platform) {0};
+    struct MtmcEmu replay = {0};
+    _TestLoadProgram(&replay, program);
+    memcpy(&replay.memory[0x100], &emu.memory[0x100], 0x104);
+    assert(MtmcSetReplay(&replay, log) == 0);
+    MtmcRun(&replay);
+    assert(MtmcGetStatus(&replay) == MtmcEmuStatus_FINISHED);
+    assert(MtmcGetRegisterValue(&replay, T0) == 0);
+    fclose(log);
+
+    char* dump = NULL;
+    size_t size = 0;
+    FILE* fp = open_memstream(&dump, &size);
+    assert(fp != NULL);
+    assert(PlatformDumpOverlay(&_platform, fp) == 0);
+    fclose(fp);
+    assert(strcmp(dump, "+ /c/f 3\nxyz\n- /d\n") == 0);
+    free(dump);
+
+    _TestDiskTearDown(&disk);
+}
+
+static void _TestPngChunk(FILE* fp, const char* type, const u8* data, u32 size) {
+    u8 header[8] = { size >> 24, size >> 16, size >> 8, size };
+    memcpy(&header[4], type, 4);
+    u32 crc = crc32(crc32(0, &header[4], 4), data, size);
+    u8 trailer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+    fwrite(header, 1, sizeof(header), fp);
+    fwrite(data, 1, size, fp);
+    fwrite(trailer, 1, sizeof(trailer), fp);
+}
+
+/* Writes an indexed image cycling rows through all five filter types,
+   with the compressed stream split over idats chunks. */
+static void _TestWriteIndexedPng(FILE* fp, int width, int height, int depth,
+    int idats) {
+    static const u8 signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    fwrite(signature, 1, sizeof(signature), fp);
+    u8 ihdr[13] = { 0, 0, width >> 8, width, 0, 0, height >> 8, height,
+        depth, PNG_COLOR_TYPE_PALETTE, 0, 0, 0 };
+    _TestPngChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+    int colors = depth == 1 ? 2 : depth == 2 ? 4 : 5;
+    u8 plte[5 * 3];
+    for (int i = 0; i < colors; ++i) {
+        plte[i * 3] = _MtmcPngPalette[i].red;
+        plte[i * 3 + 1] = _MtmcPngPalette[i].green;
+        plte[i * 3 + 2] = _MtmcPngPalette[i].blue;
+    }
+    _TestPngChunk(fp, "PLTE", plte, colors * 3);
+    const u8 trns[5] = { 255, 255, 255, (colors == 4 ? 0 : 255), 0 };
+    if (colors > 2) {
+        _TestPngChunk(fp, "tRNS", trns, colors);
+    }
+
+    size_t n = (width * depth + 7) / 8;
+    u8 raw[height * (n + 1)];
+    u8 prev[n], cur[n];
+    memset(prev, 0, n);
+    for (int row = 0; row < height; ++row) {
+        memset(cur, 0, n);
+        for (int col = 0; col < width; ++col) {
+            int index = (row * 7 + col * 3 + row * col) % colors;
+            int bit = col * depth;
+            cur[bit / 8] |= index << (8 - depth - bit % 8);
+        }
+        u8* out = &raw[row * (n + 1)];
+        out[0] = row % 5;
+        for (size_t i = 0; i < n; ++i) {
+            int a = i > 0 ? cur[i - 1] : 0, b = prev[i], c = i > 0 ? prev[i - 1] : 0;
+            int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+            int predict[5] = { 0, a, b, (a + b) / 2,
+                (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c };
+            out[i + 1] = cur[i] - predict[out[0]];
+        }
+        memcpy(prev, cur, n);
+    }
+
+    uLongf size = compressBound(sizeof(raw));
+    u8 idat[size];
+    assert(compress(idat, &size, raw, sizeof(raw)) == Z_OK);
+    size_t part = (size + idats - 1) / idats;
+    for (size_t pos = 0; pos < size; pos += part) {
+        _TestPngChunk(fp, "IDAT", &idat[pos], pos + part < size ? part : size - pos);
+    }
+    _TestPngChunk(fp, "IEND", idat, 0);
+}
+
+static void testPngIndexedDecode(void) {
+    static const int cases[][4] = {
+        /* width, height, depth, IDAT chunks */
+        { 13, 10, 8, 1 },
+        { 13, 10, 8, 7 },
+        { 37, 10, 4, 3 },
+        { 37, 10, 2, 1 },
+        { 37, 10, 1, 2 },
+        { 500, 5, 8, 4 },
+    };
+    static struct MtmcGraphic fast, slow;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        char* png = NULL;
+        size_t size = 0;
+        FILE* fp = open_memstream(&png, &size);
+        assert(fp != NULL);
+        _TestWriteIndexedPng(fp, cases[i][0], cases[i][1], cases[i][2], cases[i][3]);
+        fclose(fp);
+
+        memset(&fast, 0xAA, sizeof(fast));
+        assert(_MtmcGraphicLoadIndexedPng(&fast, (const u8*) png, size) == 0);
+        fp = fmemopen(png, size, "rb");
+        assert(fp != NULL);
+        assert(MtmcGraphicLoad(&slow, fp) == 0);
+        fclose(fp);
+        assert(fast.width == cases[i][0] && fast.height == cases[i][1]);
+        assert(memcmp(&fast, &slow, sizeof(fast)) == 0);
+
+        /* a flipped bit in the stream fails the CRC, not the decode */
+        png[size - 20] ^= 1;
+        assert(_MtmcGraphicLoadIndexedPng(&fast, (const u8*) png, size) != 0);
+        free(png);
+    }
+}
+
+static void testHeadlessFrame(void) {
+    PlatformDeinit(&_platform);
+    _platform = (struct Platform) {
+        .screen_width = MtmcDisplay_width,
+        .screen_height = MtmcDisplay_height,
+        .headless = 1,
+    };
+    struct MtmcEmu emu = {0};
+    _TestLoadProgram(&emu, "sys fbreset\nsys fbrect\nsys fbflush\nsys joystick");
+    MtmcSetRegisterValue(&emu, A0, 1);
+    MtmcSetRegisterValue(&emu, A1, 2);
+    MtmcSetRegisterValue(&emu, A2, 1);
+    MtmcSetRegisterValue(&emu, A3, 1);
+    MtmcRun(&emu);
+    assert(MtmcGetStatus(&emu) == MtmcEmuStatus_FINISHED);
+    assert(_platform.window == NULL && _platform.canvas != NULL);
+    size_t n = MtmcDisplay_height * 2 - 3;
+    assert(_platform.canvas[n] == MtmcDisplayColor_DARK);
+    assert(_platform.canvas[n - 1] == MtmcDisplayColor_LIGHTEST);
+    PlatformDeinit(&_platform);
+    _platform = (struct Platform) {0};
+}
+
+static void testCellsPattern(void) {
+    const char pattern[] =
+        "!Name: test\n"
+        "\n"
+        ".O\n"
+        "OOOOOOOOO.O\n"
+        "\n"
+        "O.........O.......O";
+    u8 buf[11];
+    memset(buf, 0xAA, sizeof(buf));
+    assert(_PlatformParseCells(pattern, strlen(pattern), buf, 16, 5) == 0);
+    const u8 expected[10] = {0x02, 0, 0xFF, 0x05, 0, 0, 0x01, 0x04, 0, 0};
+    assert(memcmp(buf, expected, sizeof(expected)) == 0);
+    assert(buf[10] == 0xAA);
+}
+
+static void testAssemblerTables(void) {
+    size_t n = 5000;
+    char* buf = malloc(n * 8 + 16);
+    assert(buf != NULL);
+    size_t size = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size += sprintf(&buf[size], "l%zu:\n", i);
+    }
+    size += sprintf(&buf[size], "j l%zu\n", n - 1);
+    for (int k = 0; k < 2; ++k) {
+        struct MtmcExeObject obj = {0};
+        FILE* source = fmemopen(buf, size, "rb");
+        assert(source != NULL);
+        assert(MtmcAssemblerCompileSource(source, &obj, NULL) == 0);
+        fclose(source);
+        assert(obj.codesize == 2);
+    }
+    free(buf);
+    MtmcAssemblerReleaseMemory();
+}
+
 static void testMov(void) {
     struct MtmcEmu emu = {0};
     _TestLoadProgram(&emu, "mov t1 t0");
@@ -1484,6 +2493,41 @@ static void testJumpAndLink(void) {
 
 int main(int argc, const char* argv[]) {
     testSysCall();
+    testSysCallTable();
+    testWriteIntCapture();
+    testPrintFormat();
+    testOutputFlushThreshold();
+    testReadString();
+    testReadIntAndChar();
+    testMemCopy();
+    testMemCopySysCallOverlap();
+    testMemCopyOutOfRange();
+    testFileNameOutOfRange();
+    testInstructionBudget();
+    testSysCallBudget();
+    testExpectedOutput();
+    testExpectedOutputMismatch();
+    testExpectedOutputMissing();
+    testVirtualClock();
+    testBusyWaitTimer();
+    testBusyWaitVirtualTimer();
+    testBusyWaitWithWork();
+    testRandomRange();
+    testRandomSeed();
+    testRecordReplay();
+    testReplayDiverged();
+    testDirentListing();
+    testDiskImage();
+    testDiskOverlay();
+    testDiskSymlinkSwap();
+    testReplayFileWrite();
+    testJsonIntArray();
+    testJsonStreamRefill();
+    testLinkExecutableRoundTrip();
+    testCellsPattern();
+    testHeadlessFrame();
+    testPngIndexedDecode();
+    testAssemblerTables();
     testMov();
     testInc();
     testInc3();